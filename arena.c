@@ -30,6 +30,9 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <string.h>
 #include "arena.h"
 
+// optional observer of every allocation (+bytes) and release (-bytes)
+void (*arena_observer)(void*, void*, int);
+
 int
 arena_within (void *pool, void *ptr)
 {
@@ -37,11 +40,26 @@ arena_within (void *pool, void *ptr)
   return ptr > pool && ptr < pool + arena->bytes;
 }
 
+// the long runs list follows the page flags; at most one run in every
+// ARENA_SMALL+1 pages can be long
+static unsigned int*
+arena_longs (arena_t *arena)
+{
+  size_t offset = arena->pages + (arena->pages % sizeof(unsigned int) ? sizeof(unsigned int) - arena->pages % sizeof(unsigned int): 0);
+  return (unsigned int*)(arena->flags + offset);
+}
+
+static size_t
+arena_layout (arena_t *arena)
+{
+  size_t offset = (void*)(arena_longs(arena) + arena->pages / ARENA_SMALL + 1) - (void*)arena;
+  return offset + (offset % sizeof(void*) ? (sizeof(void*) - (offset % sizeof(void*))): 0); // aligned
+}
+
 static void*
 arena_data (arena_t *arena)
 {
-  size_t offset = sizeof(arena_t) + arena->pages;
-  return (void*)arena + offset + (offset % sizeof(void*) ? (sizeof(void*) - (offset % sizeof(void*))): 0); // aligned
+  return (void*)arena + arena->data;
 }
 
 static void*
@@ -50,6 +68,114 @@ arena_page (arena_t *arena, unsigned int page_id)
   return arena_data(arena) + (page_id * arena->page_size);
 }
 
+// A free run's first page holds its length, and for a long run also its
+// slot in the long runs list. Its last page holds the length of a short
+// run, or ARENA_LONG and the slot of a long one, whose list entry is its
+// first page. Either way a long run can gain or lose pages at one end
+// without touching the page at the other.
+#define ARENA_LONG (1u<<31)
+
+static unsigned int*
+arena_tag (arena_t *arena, unsigned int page_id)
+{
+  return arena_page(arena, page_id);
+}
+
+// first page of the free run whose last page is page_id
+static unsigned int
+arena_run_start (arena_t *arena, unsigned int page_id)
+{
+  unsigned int tag = arena_tag(arena, page_id)[0];
+  return tag & ARENA_LONG ? arena_longs(arena)[tag & ~ARENA_LONG]: page_id - tag + 1;
+}
+
+static void
+arena_run_add (arena_t *arena, unsigned int page_id, unsigned int length)
+{
+  unsigned int *first = arena_tag(arena, page_id);
+  unsigned int *last = arena_tag(arena, page_id + length - 1);
+
+  first[0] = length;
+  arena->runs++;
+
+  if (length < ARENA_SMALL)
+  {
+    last[0] = length;
+    arena->shorts[length]++;
+    return;
+  }
+
+  arena_longs(arena)[arena->longs] = page_id;
+  first[1] = arena->longs;
+  last[0] = ARENA_LONG | arena->longs++;
+}
+
+static void
+arena_run_del (arena_t *arena, unsigned int page_id, unsigned int length)
+{
+  arena->runs--;
+
+  if (length < ARENA_SMALL)
+  {
+    arena->shorts[length]--;
+    return;
+  }
+
+  // the last long run takes over the slot
+  unsigned int *longs = arena_longs(arena);
+  unsigned int slot = arena_tag(arena, page_id)[1];
+  unsigned int moved = longs[--arena->longs];
+
+  if (moved == page_id)
+    return;
+
+  unsigned int *first = arena_tag(arena, moved);
+
+  longs[slot] = moved;
+  first[1] = slot;
+  arena_tag(arena, moved + first[0] - 1)[0] = ARENA_LONG | slot;
+}
+
+// A run starts at page_id and is length pages long, but long runs may
+// stay put while they shrink or grow at one end
+static void
+arena_run_set (arena_t *arena, unsigned int page_id, unsigned int length, unsigned int old_id, unsigned int old_length)
+{
+  if (old_length >= ARENA_SMALL && length >= ARENA_SMALL && old_id + old_length == page_id + length)
+  {
+    // same last page: the run moved its first page
+    unsigned int *first = arena_tag(arena, page_id);
+    unsigned int slot = arena_tag(arena, old_id)[1];
+
+    first[0] = length;
+    first[1] = slot;
+    arena_longs(arena)[slot] = page_id;
+    return;
+  }
+
+  if (old_length >= ARENA_SMALL && length >= ARENA_SMALL && old_id == page_id)
+  {
+    // same first page: the run moved its last page
+    unsigned int *first = arena_tag(arena, page_id);
+
+    first[0] = length;
+    arena_tag(arena, page_id + length - 1)[0] = ARENA_LONG | first[1];
+    return;
+  }
+
+  if (old_length < ARENA_SMALL && length < ARENA_SMALL)
+  {
+    arena->shorts[old_length]--;
+    arena->shorts[length]++;
+    arena_tag(arena, page_id)[0] = length;
+    arena_tag(arena, page_id + length - 1)[0] = length;
+    return;
+  }
+
+  arena_run_del(arena, old_id, old_length);
+  arena_run_add(arena, page_id, length);
+}
+
 int
 arena_open (void *pool, unsigned int bytes, unsigned int page_size)
 {
@@ -61,9 +187,14 @@ arena_open (void *pool, unsigned int bytes, unsigned int page_size)
   arena->page_size = page_size;
   arena->start_scan = 0;
 
-  while (arena->pages > 0 && (arena_data(arena) + (arena->pages * page_size)) - pool > bytes)
+  while (arena->pages > 0 && arena_layout(arena) + (size_t)arena->pages * page_size > bytes)
     arena->pages--;
 
+  arena->data = arena_layout(arena);
+
+  if (arena->pages)
+    arena_run_add(arena, 0, arena->pages);
+
   return 0;
 }
 
@@ -74,6 +205,9 @@ arena_close (void *pool)
   return 0;
 }
 
+// First fit. Pages before start_scan are all in use, so every free page
+// found by skipping runs and then allocations starts a run, whose length
+// is in its tag.
 void*
 arena_alloc (void *pool, unsigned int bytes)
 {
@@ -82,34 +216,49 @@ arena_alloc (void *pool, unsigned int bytes)
   arena_t *arena = pool;
 
   unsigned int pages = (bytes / arena->page_size) + (bytes % arena->page_size ? 1:0);
-  unsigned int gap = 0;
 
   unsigned char *flags = &arena->flags[arena->start_scan];
   unsigned char *limit = arena->flags + arena->pages;
 
-  while (flags < limit && (flags = memchr(flags, 0, limit - flags)) && flags && limit - flags >= pages)
+  while (flags < limit && (flags = memchr(flags, 0, limit - flags)) && limit - flags >= pages)
   {
-    for (gap = 1;
-      gap && gap < pages;
-      gap = flags[gap] ? 0: gap+1
-    );
+    unsigned int page_id = flags - arena->flags;
+    unsigned int run = arena_tag(arena, page_id)[0];
 
-    if (gap == pages)
+    if (run < pages)
     {
-      unsigned int page_id = flags - arena->flags;
-      memset(&arena->flags[page_id], 1, pages);
+      flags += run;
+      continue;
+    }
 
-      arena->flags[page_id+(pages-1)] = 3;
-      ptr = arena_page(arena, page_id);
+    if (run > pages)
+      arena_run_set(arena, page_id + pages, run - pages, page_id, run);
+    else
+      arena_run_del(arena, page_id, run);
 
-      if (page_id == arena->start_scan)
-        arena->start_scan = page_id + pages;
+    memset(&arena->flags[page_id], 1, pages);
 
-      break;
-    }
-    flags++;
+    arena->flags[page_id+(pages-1)] = 3;
+    ptr = arena_page(arena, page_id);
+
+    if (page_id == arena->start_scan)
+      arena->start_scan = page_id + pages;
+
+    arena->used += pages;
+    arena->allocs++;
+
+    if (arena->used > arena->peak)
+      arena->peak = arena->used;
+
+    if (arena_observer)
+      arena_observer(pool, ptr, pages * arena->page_size);
+
+    break;
   }
 
+  if (!ptr)
+    arena->failures++;
+
   return ptr;
 }
 
@@ -130,6 +279,7 @@ arena_free (void *pool, void *ptr)
   if (page_id < arena->start_scan)
     arena->start_scan = page_id;
 
+  int first_page_id = page_id;
   int last_page = 0;
 
   while (!last_page && page_id < arena->pages)
@@ -137,6 +287,33 @@ arena_free (void *pool, void *ptr)
     last_page = arena->flags[page_id] & 2;
     arena->flags[page_id++] = 0;
   }
+
+  // merge with the free runs either side
+  unsigned int length = page_id - first_page_id;
+  unsigned int right = page_id < arena->pages && !arena->flags[page_id] ? arena_tag(arena, page_id)[0]: 0;
+
+  if (first_page_id > 0 && !arena->flags[first_page_id-1])
+  {
+    unsigned int start = arena_run_start(arena, first_page_id-1);
+    unsigned int left = first_page_id - start;
+
+    if (right)
+      arena_run_del(arena, page_id, right);
+
+    arena_run_set(arena, start, left + length + right, start, left);
+  }
+  else
+  if (right)
+    arena_run_set(arena, first_page_id, length + right, page_id, right);
+  else
+    arena_run_add(arena, first_page_id, length);
+
+  arena->used -= page_id - first_page_id;
+  arena->frees++;
+
+  if (arena_observer)
+    arena_observer(pool, ptr, -(page_id - first_page_id) * arena->page_size);
+
   return 0;
 }
 
@@ -182,16 +359,62 @@ arena_realloc (void *pool, void *old, unsigned int bytes)
   return new;
 }
 
+// Walk allocations in address order: the first one after ptr, or the
+// first in the arena when ptr is NULL.
+void*
+arena_next (void *pool, void *ptr)
+{
+  arena_t *arena = pool;
+  unsigned int page_id = 0;
+
+  if (ptr)
+  {
+    page_id = (ptr - arena_data(arena)) / arena->page_size;
+
+    while (page_id < arena->pages && !(arena->flags[page_id] & 2))
+      page_id++;
+
+    page_id++;
+  }
+
+  while (page_id < arena->pages && !arena->flags[page_id])
+    page_id++;
+
+  return page_id < arena->pages ? arena_page(arena, page_id): NULL;
+}
+
+// pages in use, maintained by arena_alloc and arena_free
 unsigned int
 arena_usage (void *pool)
+{
+  return ((arena_t*)pool)->used;
+}
+
+// pages in the largest contiguous free run: the longest of the long runs
+// if there are any, else the longest short length with a run
+unsigned int
+arena_largest (void *pool)
 {
   arena_t *arena = pool;
-  unsigned char *flags = &arena->flags[0];
-  unsigned char *limit = arena->flags + arena->pages;
+  unsigned int *longs = arena_longs(arena);
+  unsigned int largest = 0;
 
-  unsigned int pages_used = 0;
-  for (unsigned int page_id = 0; &flags[page_id] < limit; page_id++)
-    if (flags[page_id]) pages_used++;
+  for (unsigned int i = 0; i < arena->longs; i++)
+  {
+    unsigned int run = arena_tag(arena, longs[i])[0];
+    if (run > largest) largest = run;
+  }
 
-  return pages_used;
+  for (unsigned int length = ARENA_SMALL-1; !largest && length > 0; length--)
+    if (arena->shorts[length]) largest = length;
+
+  return largest;
+}
+
+// number of separate free runs; more runs for the same free space means
+// more fragmentation
+unsigned int
+arena_runs (void *pool)
+{
+  return ((arena_t*)pool)->runs;
 }
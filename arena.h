@@ -21,11 +21,27 @@ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
 SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 */
 
+// Free runs of pages are tracked as they change. A free run keeps its
+// length in the first word of its first and last pages, and a run of
+// ARENA_SMALL pages or more keeps its slot in the list of long runs in
+// the second word of its first page. Pages are therefore at least two
+// words, and a freed page's first two words belong to the arena.
+#define ARENA_SMALL 64
+
 typedef struct {
   unsigned int bytes;
   unsigned int pages;
   unsigned int page_size;
   unsigned int start_scan;
+  unsigned int data;
+  unsigned int used;
+  unsigned int peak;
+  unsigned int allocs;
+  unsigned int frees;
+  unsigned int failures;
+  unsigned int runs;
+  unsigned int longs;
+  unsigned int shorts[ARENA_SMALL];
   unsigned char flags[];
 } arena_t;
 
@@ -34,5 +50,10 @@ int arena_open (void*, unsigned int, unsigned int);
 int arena_close (void*);
 void* arena_alloc (void*, unsigned int);
 void* arena_realloc (void*, void*, unsigned int);
+void* arena_next (void*, void*);
 int arena_free (void*, void*);
 unsigned int arena_usage(void*);
+unsigned int arena_largest (void*);
+unsigned int arena_runs (void*);
+
+extern void (*arena_observer)(void*, void*, int);
@@ -0,0 +1,283 @@
+/*
+Copyright (c) 2016 Sean Pringle sean.pringle@gmail.com
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// Microbenchmarks for the runtime primitives, without the interpreter.
+// Output is tab separated: name, n, ops, seconds, ns/op.
+//
+//   ./microbench [max keys]
+//
+// Map and vec sizes grow by 10x from 10 up to max keys (default 10000).
+// Maps have a fixed 17 chains, so map time is quadratic in keys: 100000
+// takes about a minute, and 10M is only worth running after a rewrite.
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "arena.h"
+#include "op.h"
+#include "str.h"
+#include "vec.h"
+#include "map.h"
+#include "lt.h"
+#include "io.h"
+#include "collect.h"
+#include "sched.h"
+#include "line.h"
+#include "state.h"
+
+static double
+now ()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+report (const char *name, int n, int64_t ops, double seconds)
+{
+  printf("%s\t%d\t%ld\t%.6f\t%.1f\n", name, n, ops, seconds, ops ? seconds * 1e9 / ops: 0.0);
+  fflush(stdout);
+}
+
+static uint32_t seed = 2463534242u;
+
+static uint32_t
+rnd ()
+{
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed;
+}
+
+static arena_t*
+pool (unsigned int bytes, unsigned int page_size)
+{
+  arena_t *arena = heap_alloc(bytes);
+  arena_open(arena, bytes, page_size);
+  return arena;
+}
+
+// arenas sized for max keys, laid out the way main() does it
+static void
+setup (int keys)
+{
+  lt = calloc(1, sizeof(lt_state));
+  ensure(lt) errorf("calloc lt_state");
+
+  ints_mem = keys * 3 * sizeof(int64_t) + 1*MB;
+  strs_mem = keys * 3 * 32 + 4*MB;
+  maps_mem = (keys / 17 + 1024) * sizeof(map_t);
+  vecs_mem = 1*MB;
+  dbls_mem = cors_mem = subs_mem = slcs_mem = ios_mem = 64*KB;
+
+  int64_t node_mem = (int64_t)maps_mem / sizeof(map_t) * 17 * sizeof(node_t);
+  int64_t total = (int64_t)ints_mem + strs_mem + maps_mem + vecs_mem + node_mem
+    + (int64_t)keys * sizeof(void*) * 4 + 5 * 64*KB + 64*MB;
+
+  ensure(total < INT32_MAX)
+    errorf("too many keys for one heap: %d", keys);
+
+  heap_mem = total;
+  heap = malloc(heap_mem);
+  ensure(heap) errorf("malloc heap %d", heap_mem);
+  arena_open(heap, heap_mem, 1024);
+
+  ints = pool(ints_mem, sizeof(int64_t));
+  dbls = pool(dbls_mem, sizeof(double));
+  strs = pool(strs_mem, 32);
+  vecs = pool(vecs_mem, sizeof(vec_t));
+  maps = pool(maps_mem, sizeof(map_t));
+  cors = pool(cors_mem, sizeof(cor_t));
+  subs = pool(subs_mem, sizeof(int64_t));
+  slcs = pool(slcs_mem, sizeof(slc_t));
+  ios = pool(ios_mem, sizeof(io_t));
+}
+
+// alloc/free pairs of 1-8 pages, on a clean arena and on one where every
+// other block of a full arena has been freed
+static void
+bench_arena ()
+{
+  unsigned int bytes = 4*MB, page = 32;
+  int blocks = bytes / page / 8;
+  int ops = 100000;
+
+  void *arena = malloc(bytes);
+  void **ptrs = calloc(blocks, sizeof(void*));
+  void **live = calloc(64, sizeof(void*));
+  ensure(arena && ptrs && live) errorf("%s malloc", __func__);
+
+  for (int fragmented = 0; fragmented < 2; fragmented++)
+  {
+    arena_open(arena, bytes, page);
+
+    if (fragmented)
+    {
+      for (int i = 0; i < blocks && (ptrs[i] = arena_alloc(arena, page * (1 + rnd() % 8))); i++);
+      for (int i = 0; i < blocks; i += 2) arena_free(arena, ptrs[i]);
+    }
+
+    double start = now();
+
+    for (int i = 0; i < ops; i++)
+    {
+      int slot = rnd() % 64;
+      arena_free(arena, live[slot]);
+      live[slot] = arena_alloc(arena, page * (1 + rnd() % 8));
+    }
+
+    report(fragmented ? "arena_alloc_free_fragmented": "arena_alloc_free", blocks, ops, now() - start);
+    memset(live, 0, sizeof(void*) * 64);
+  }
+
+  free(live);
+  free(ptrs);
+  free(arena);
+}
+
+static void
+bench_map (int n, int strings)
+{
+  void **keys = calloc(n, sizeof(void*));
+  ensure(keys) errorf("%s calloc", __func__);
+
+  for (int i = 0; i < n; i++)
+    keys[i] = strings ? (void*)strf("key:%d", i): (void*)to_int(i);
+
+  map_t *map = map_incref(map_alloc());
+
+  double start = now();
+
+  for (int i = 0; i < n; i++)
+    map_set(map, keys[i])[0] = to_int(i);
+
+  report(strings ? "map_set_str": "map_set_int", n, n, now() - start);
+
+  start = now();
+  int64_t found = 0;
+
+  for (int i = 0; i < n; i++)
+    found += map_get(map, keys[rnd() % n]) != NULL;
+
+  report(strings ? "map_get_str": "map_get_int", n, found, now() - start);
+
+  map_decref(map);
+
+  for (int i = 0; i < n; i++)
+    discard(keys[i]);
+
+  free(keys);
+}
+
+static void
+bench_vec (int n)
+{
+  vec_t *vec = vec_incref(vec_alloc());
+
+  double start = now();
+
+  for (int i = 0; i < n; i++)
+    vec_push(vec)[0] = NULL;
+
+  report("vec_push", n, n, now() - start);
+  vec_decref(vec);
+
+  // inserting at the front moves every item
+  if (n > 100000) return;
+
+  vec = vec_incref(vec_alloc());
+  start = now();
+
+  for (int i = 0; i < n; i++)
+    vec_ins(vec, 0)[0] = NULL;
+
+  report("vec_ins_front", n, n, now() - start);
+  vec_decref(vec);
+}
+
+static void
+bench_str ()
+{
+  int ops = 1000000;
+  char *text = strf("%s", "the quick brown fox jumps over the lazy dog, again and again and again");
+  int length = strlen(text);
+
+  double start = now();
+
+  for (int i = 0; i < ops; i++)
+    discard(substr(text, i % (length - 16), 16));
+
+  report("substr_16", length, ops, now() - start);
+
+  start = now();
+
+  for (int i = 0; i < ops; i++)
+    discard(strf("%d:%s", i, "value"));
+
+  report("strf_int_str", 0, ops, now() - start);
+
+  start = now();
+  volatile uint32_t sum = 0;
+
+  for (int i = 0; i < ops; i++)
+    sum += str_djb_hash(text);
+
+  report("str_djb_hash", length, ops, now() - start);
+
+  discard(text);
+}
+
+int
+main (int argc, char const *argv[])
+{
+  int max = argc > 1 ? strtol(argv[1], NULL, 0): 10000;
+  if (max < 10) max = 10;
+
+  setup(max);
+
+  printf("name\tn\tops\tseconds\tns_per_op\n");
+
+  bench_arena();
+
+  for (int n = 10; n <= max; n *= 10)
+    bench_map(n, 0);
+
+  for (int n = 10; n <= max; n *= 10)
+    bench_map(n, 1);
+
+  for (int n = 10; n <= max; n *= 10)
+    bench_vec(n);
+
+  bench_str();
+
+  return 0;
+}
@@ -0,0 +1,63 @@
+#!/bin/sh
+# Run each bench/*.lt workload several times, check its output against
+# bench/<name>.out, and report the median wall time, peak RSS and the
+# objects created in each pool, as reported by --stats.
+#
+#   sh bench/run.sh [./lt] [runs]
+
+LT=${1:-./lt}
+RUNS=${2:-${BENCH_RUNS:-5}}
+DIR=$(dirname "$0")
+STATS=${TMPDIR:-/tmp}/lt-bench.$$
+OUT=${TMPDIR:-/tmp}/lt-bench-out.$$
+POOLS="ints dbls strs vecs maps cors subs slcs"
+
+trap 'rm -f "$STATS" "$OUT"' EXIT
+
+printf "%-14s %10s %10s" "bench" "median ms" "rss KB"
+for pool in $POOLS; do printf " %9s" "$pool"; done
+printf "\n"
+
+for script in "$DIR"/*.lt
+do
+  name=$(basename "$script" .lt)
+  times=""
+  run=0
+
+  while [ $run -lt "$RUNS" ]
+  do
+    start=$(date +%s%N)
+
+    if ! "$LT" --stats "$script" </dev/null >"$OUT" 2>"$STATS"
+    then
+      echo "$name: failed" >&2
+      tail -5 "$STATS" >&2
+      exit 1
+    fi
+
+    end=$(date +%s%N)
+
+    if ! cmp -s "$OUT" "$DIR/$name.out"
+    then
+      echo "$name: wrong output" >&2
+      diff "$DIR/$name.out" "$OUT" | head -5 >&2
+      exit 1
+    fi
+
+    times="$times $(( (end - start) / 1000000 ))"
+    run=$((run + 1))
+  done
+
+  median=$(echo $times | tr ' ' '\n' | sort -n | awk '{ t[NR] = $1 } END { print t[int((NR + 1) / 2)] }')
+  rss=$(awk '/^PEAK/ { print $3 }' "$STATS")
+
+  printf "%-14s %10s %10s" "$name" "$median" "$rss"
+
+  for pool in $POOLS
+  do
+    created=$(awk -v pool="$pool:" '/^CREATE/ { for (i = 2; i < NF; i++) if ($i == pool) { n = $(i + 1); sub(/,$/, "", n); print n } }' "$STATS")
+    printf " %9s" "$created"
+  done
+
+  printf "\n"
+done
@@ -0,0 +1,327 @@
+/*
+Copyright (c) 2016 Sean Pringle sean.pringle@gmail.com
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "arena.h"
+#include "op.h"
+#include "str.h"
+#include "vec.h"
+#include "map.h"
+#include "lt.h"
+#include "cache.h"
+#include "line.h"
+#include "collect.h"
+#include "io.h"
+#include "sched.h"
+#include "state.h"
+
+// A cache file is a header, one record per code_t, one record per OP_FOR
+// variable name, a pool of string bytes, then the line table. Loading maps the file and
+// string literals become slices of the mapping.
+
+enum {
+  CACHE_NIL=0,
+  CACHE_INT,
+  CACHE_DBL,
+  CACHE_SUB,
+  CACHE_STR,
+  CACHE_VEC,
+};
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t opcodes;
+  uint32_t length;
+  uint32_t base;
+  uint32_t codes;
+  uint32_t items;
+  uint32_t pool;
+  uint32_t lines;
+  uint64_t hash;
+} cache_head_t;
+
+typedef struct {
+  int32_t op;
+  int32_t offset;
+  int32_t type;
+  int32_t length;
+  int64_t value;
+} cache_code_t;
+
+static int
+cache_type (void *ptr)
+{
+  if (!ptr) return CACHE_NIL;
+  if (is_int(ptr)) return CACHE_INT;
+  if (is_dbl(ptr)) return CACHE_DBL;
+  if (is_sub(ptr)) return CACHE_SUB;
+  if (is_text(ptr)) return CACHE_STR;
+  if (is_vec(ptr)) return CACHE_VEC;
+  return -1;
+}
+
+static void
+cache_head (cache_head_t *head, slc_t *text, int base)
+{
+  memset(head, 0, sizeof(cache_head_t));
+  memcpy(head->magic, "ltc", 4);
+  head->version = CACHE_VERSION;
+  head->opcodes = OP_CUSTOM;
+  head->hash = str_fnv_hash_len(get_str(text), count(text));
+  head->length = count(text);
+  head->base = base;
+}
+
+static void
+cache_item (cache_code_t *rec, void *ptr, uint32_t *items, uint32_t *pool)
+{
+  rec->type = cache_type(ptr);
+
+  switch (rec->type)
+  {
+    case CACHE_INT: rec->value = get_int(ptr); break;
+    case CACHE_DBL: memcpy(&rec->value, ptr, sizeof(double)); break;
+    case CACHE_SUB: rec->value = get_sub(ptr); break;
+    case CACHE_STR: rec->value = *pool; rec->length = count(ptr); *pool += rec->length + 1; break;
+    case CACHE_VEC: rec->value = *items; rec->length = ((vec_t*)ptr)->count; *items += rec->length; break;
+  }
+}
+
+static int
+cache_str (FILE *file, void *ptr)
+{
+  return fwrite(get_str(ptr), 1, count(ptr), file) == count(ptr) && fputc(0, file) == 0;
+}
+
+int
+cache_save (char *path, slc_t *text, int base)
+{
+  cache_head_t head;
+  cache_head(&head, text, base);
+  head.codes = code_count - base;
+
+  for (int i = base; i < code_count; i++)
+  {
+    int type = cache_type(code[i].ptr);
+    if (type < 0) return 0;
+
+    if (type == CACHE_VEC)
+    {
+      vec_t *vec = code[i].ptr;
+      for (int j = 0; j < vec->count; j++)
+        if (cache_type(vec->items[j]) != CACHE_STR) return 0;
+    }
+  }
+
+  // write to a temporary file and rename, so concurrent runs never see
+  // a partial cache
+  char *temp = strf("%s.%d", path, getpid());
+  FILE *file = fopen(temp, "w");
+
+  if (!file)
+  {
+    discard(temp);
+    return 0;
+  }
+
+  int ok = 1;
+  uint32_t items = 0, pool = 0;
+  cache_code_t rec;
+
+  ok = ok && fwrite(&head, sizeof(head), 1, file) == 1;
+
+  for (int i = base; ok && i < code_count; i++)
+  {
+    memset(&rec, 0, sizeof(rec));
+    rec.op = code[i].op;
+    rec.offset = code[i].offset;
+    cache_item(&rec, code[i].ptr, &items, &pool);
+    ok = fwrite(&rec, sizeof(rec), 1, file) == 1;
+  }
+
+  head.items = items;
+
+  for (int i = base; ok && i < code_count; i++)
+  {
+    if (cache_type(code[i].ptr) != CACHE_VEC) continue;
+
+    vec_t *vec = code[i].ptr;
+    for (int j = 0; ok && j < vec->count; j++)
+    {
+      memset(&rec, 0, sizeof(rec));
+      cache_item(&rec, vec->items[j], &items, &pool);
+      ok = fwrite(&rec, sizeof(rec), 1, file) == 1;
+    }
+  }
+
+  head.pool = pool;
+
+  // pool offsets were assigned code strings first, then variable names
+  for (int i = base; ok && i < code_count; i++)
+    if (cache_type(code[i].ptr) == CACHE_STR)
+      ok = cache_str(file, code[i].ptr);
+
+  for (int i = base; ok && i < code_count; i++)
+  {
+    if (cache_type(code[i].ptr) != CACHE_VEC) continue;
+
+    vec_t *vec = code[i].ptr;
+    for (int j = 0; ok && j < vec->count; j++)
+      ok = cache_str(file, vec->items[j]);
+  }
+
+  head.lines = line_bytes;
+  ok = ok && fwrite(line_table, 1, line_bytes, file) == line_bytes;
+
+  ok = ok && fseek(file, 0, SEEK_SET) == 0 && fwrite(&head, sizeof(head), 1, file) == 1;
+  ok = fclose(file) == 0 && ok;
+  ok = ok && rename(temp, path) == 0;
+
+  if (!ok)
+    unlink(temp);
+
+  discard(temp);
+  return ok;
+}
+
+// A record is only trusted if it can be rebuilt without reaching outside
+// the mapping: a known opcode, jumps that land inside this image, and
+// value indexes within the sub, item and pool ranges. Item records for
+// OP_FOR names must be strings.
+static int
+cache_check (cache_code_t *rec, cache_head_t *file, int base, int item)
+{
+  uint64_t end = (uint64_t)base + file->codes;
+
+  if (!item && (rec->op <= 0 || rec->op >= OP_CUSTOM)) return 0;
+  if (!item && is_jump(rec->op) && (rec->offset < base || rec->offset > end)) return 0;
+  if (rec->length < 0) return 0;
+
+  switch (rec->type)
+  {
+    case CACHE_NIL:
+    case CACHE_INT:
+    case CACHE_DBL:
+      return !item;
+    case CACHE_SUB:
+      return !item && rec->value >= base && rec->value < end;
+    case CACHE_STR:
+      return rec->value >= 0 && rec->value < file->pool
+        && rec->length < file->pool - rec->value;
+    case CACHE_VEC:
+      return !item && rec->value >= 0 && rec->value <= file->items
+        && rec->length <= file->items - rec->value;
+  }
+  return 0;
+}
+
+static void*
+cache_ptr (cache_code_t *rec, cache_code_t *items, slc_t *slc, int pool)
+{
+  switch (rec->type)
+  {
+    case CACHE_INT: return to_int(rec->value);
+    case CACHE_DBL: { double d; memcpy(&d, &rec->value, sizeof(double)); return to_dbl(d); }
+    case CACHE_SUB: return to_sub(rec->value);
+    case CACHE_STR: return slc_incref(slc_sub(slc, pool + rec->value, rec->length));
+    case CACHE_VEC:
+    {
+      vec_t *vec = vec_incref(vec_alloc());
+      for (int i = 0; i < rec->length; i++)
+        vec_push(vec)[0] = cache_ptr(&items[rec->value + i], NULL, slc, pool);
+      return vec;
+    }
+  }
+  return NULL;
+}
+
+int
+cache_load (char *path, slc_t *text)
+{
+  slc_t *slc = slc_mmap(path);
+  if (!slc) return 0;
+
+  slc_incref(slc);
+
+  cache_head_t head;
+  cache_head(&head, text, code_count);
+
+  cache_head_t *file = (cache_head_t*)get_str(slc);
+  cache_code_t *codes = (cache_code_t*)(get_str(slc) + sizeof(cache_head_t));
+  uint64_t pool = count(slc) < sizeof(cache_head_t) ? 0
+    : sizeof(cache_head_t) + ((uint64_t)file->codes + file->items) * sizeof(cache_code_t);
+
+  int valid = pool
+    && !memcmp(file->magic, head.magic, 4)
+    && file->version == head.version
+    && file->opcodes == head.opcodes
+    && file->hash == head.hash
+    && file->length == head.length
+    && file->base == head.base
+    && pool + file->pool + file->lines == count(slc);
+
+  cache_code_t *items = &codes[file->codes];
+
+  for (int i = 0; valid && i < file->codes; i++)
+    valid = cache_check(&codes[i], file, code_count, 0);
+
+  for (int i = 0; valid && i < file->items; i++)
+    valid = cache_check(&items[i], file, code_count, 1);
+
+  if (!valid)
+  {
+    discard(slc);
+    return 0;
+  }
+
+  if (code_limit <= code_count + file->codes)
+  {
+    code_limit = code_count + file->codes + 1024;
+    code = heap_realloc(code, sizeof(code_t) * code_limit);
+    memset(&code[code_count], 0, sizeof(code_t) * (code_limit-code_count));
+  }
+
+  for (int i = 0; i < file->codes; i++)
+  {
+    code_t *c = &code[code_count++];
+    c->op = codes[i].op;
+    c->offset = codes[i].offset;
+    c->ptr = cache_ptr(&codes[i], items, slc, pool);
+  }
+  code[code_count].op = 0;
+
+  line_load((unsigned char*)get_str(slc) + pool + file->pool, file->lines);
+
+  discard(slc);
+  return 1;
+}
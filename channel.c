@@ -0,0 +1,297 @@
+/*
+Copyright (c) 2016 Sean Pringle sean.pringle@gmail.com
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "arena.h"
+#include "op.h"
+#include "str.h"
+#include "vec.h"
+#include "map.h"
+#include "parse.h"
+#include "lt.h"
+#include "collect.h"
+#include "io.h"
+#include "sched.h"
+#include "line.h"
+#include "thread.h"
+#include "channel.h"
+#include "state.h"
+
+// A slot keeps its message buffer between uses, so a busy channel stops
+// calling malloc once every slot has held its largest message. Senders
+// and receivers only claim slots under the lock; packing and unpacking
+// happen outside it, so several threads can be copying at once.
+enum {
+  SLOT_EMPTY = 0,
+  SLOT_FILLING,
+  SLOT_FULL,
+  SLOT_DRAINING,
+};
+
+typedef struct {
+  msg_t msg;
+  int state;
+} slot_t;
+
+typedef struct channel {
+  pthread_mutex_t mutex;
+  pthread_cond_t readable;
+  pthread_cond_t writable;
+  slot_t *slots;
+  int limit;
+  uint64_t head;
+  uint64_t tail;
+  int readers;
+  int writers;
+  int closed;
+  int refs;
+} channel_t;
+
+// a new channel holding up to capacity messages, with no references yet
+channel_t*
+channel_open (int capacity)
+{
+  channel_t *channel = calloc(1, sizeof(channel_t));
+  ensure(channel) errorf("%s calloc", __func__);
+
+  channel->limit = capacity;
+  channel->slots = calloc(capacity, sizeof(slot_t));
+  ensure(channel->slots) errorf("%s calloc %d", __func__, capacity);
+
+  pthread_mutex_init(&channel->mutex, NULL);
+  pthread_cond_init(&channel->readable, NULL);
+  pthread_cond_init(&channel->writable, NULL);
+
+  return channel;
+}
+
+// Handles in any interpreter and messages in flight each hold a reference.
+// Whoever drops the last one is the only thread that can still reach the
+// channel, so nobody is waiting on it.
+channel_t*
+channel_hold (channel_t *channel)
+{
+  __atomic_add_fetch(&channel->refs, 1, __ATOMIC_RELAXED);
+  return channel;
+}
+
+void
+channel_release (channel_t *channel)
+{
+  if (__atomic_sub_fetch(&channel->refs, 1, __ATOMIC_ACQ_REL))
+    return;
+
+  // messages still queued may hold channels themselves
+  for (int i = 0; i < channel->limit; i++)
+    msg_free(&channel->slots[i].msg);
+
+  pthread_mutex_destroy(&channel->mutex);
+  pthread_cond_destroy(&channel->readable);
+  pthread_cond_destroy(&channel->writable);
+  free(channel->slots);
+  free(channel);
+}
+
+chan_t*
+chan_alloc (channel_t *channel)
+{
+  chan_t *chan = arena_alloc(chans, sizeof(chan_t));
+
+  ensure(chan)
+  {
+    stacktrace();
+    errorf("arena_alloc chans");
+  }
+
+  chan->channel = channel_hold(channel);
+  chan->ref_count = 0;
+  return chan;
+}
+
+static void
+ensure_chan (chan_t *chan, const char *func)
+{
+  ensure(is_chan(chan)) errorf("%s not a chan_t", func);
+}
+
+chan_t*
+chan_incref (chan_t *chan)
+{
+  ensure_chan(chan, __func__);
+
+  chan->ref_count++;
+  return chan;
+}
+
+chan_t*
+chan_decref (chan_t *chan)
+{
+  ensure_chan(chan, __func__);
+
+  if (--chan->ref_count == 0)
+  {
+    channel_release(chan->channel);
+    memset(chan, 0, sizeof(chan_t));
+    arena_free(chans, chan);
+    chan = NULL;
+  }
+  return chan;
+}
+
+// the interpreter is closing and its arenas go in one piece
+void
+chan_free_all ()
+{
+  for (chan_t *chan = arena_next(chans, NULL); chan; chan = arena_next(chans, chan))
+    channel_release(chan->channel);
+}
+
+// Copy value into the channel. With block set, wait for space; otherwise
+// return CHANNEL_FULL at once.
+int
+channel_send (chan_t *chan, void *value, int block)
+{
+  channel_t *channel = chan->channel;
+
+  pthread_mutex_lock(&channel->mutex);
+
+  slot_t *slot = NULL;
+
+  // the tail slot is empty only once its previous message has been read
+  for (;;)
+  {
+    slot = &channel->slots[channel->tail % channel->limit];
+
+    if (channel->closed || slot->state == SLOT_EMPTY || !block)
+      break;
+
+    channel->writers++;
+    pthread_cond_wait(&channel->writable, &channel->mutex);
+    channel->writers--;
+  }
+
+  int status = channel->closed ? CHANNEL_CLOSED
+    : slot->state != SLOT_EMPTY ? CHANNEL_FULL: CHANNEL_OK;
+
+  if (status == CHANNEL_OK)
+  {
+    slot->state = SLOT_FILLING;
+    channel->tail++;
+  }
+
+  pthread_mutex_unlock(&channel->mutex);
+
+  if (status != CHANNEL_OK)
+    return status;
+
+  msg_clear(&slot->msg);
+  msg_pack(&slot->msg, value);
+
+  pthread_mutex_lock(&channel->mutex);
+  slot->state = SLOT_FULL;
+
+  if (channel->readers)
+    pthread_cond_broadcast(&channel->readable);
+
+  pthread_mutex_unlock(&channel->mutex);
+  return CHANNEL_OK;
+}
+
+// Take the oldest message from the channel into *value. With block set,
+// wait for one; otherwise return CHANNEL_EMPTY at once. A closed channel
+// still delivers what was sent before it closed.
+int
+channel_recv (chan_t *chan, void **value, int block)
+{
+  *value = NULL;
+
+  channel_t *channel = chan->channel;
+
+  pthread_mutex_lock(&channel->mutex);
+
+  slot_t *slot = NULL;
+
+  for (;;)
+  {
+    slot = &channel->slots[channel->head % channel->limit];
+
+    if (slot->state == SLOT_FULL || !block
+      || (channel->closed && channel->head == channel->tail))
+      break;
+
+    channel->readers++;
+    pthread_cond_wait(&channel->readable, &channel->mutex);
+    channel->readers--;
+  }
+
+  int status = slot->state == SLOT_FULL ? CHANNEL_OK
+    : channel->closed && channel->head == channel->tail ? CHANNEL_CLOSED: CHANNEL_EMPTY;
+
+  if (status == CHANNEL_OK)
+  {
+    slot->state = SLOT_DRAINING;
+    channel->head++;
+  }
+
+  pthread_mutex_unlock(&channel->mutex);
+
+  if (status != CHANNEL_OK)
+    return status;
+
+  int offset = 0;
+  *value = msg_unpack(&slot->msg, &offset);
+
+  // drop any channels the message held now rather than at the next send
+  msg_clear(&slot->msg);
+
+  pthread_mutex_lock(&channel->mutex);
+  slot->state = SLOT_EMPTY;
+
+  if (channel->writers)
+    pthread_cond_broadcast(&channel->writable);
+
+  pthread_mutex_unlock(&channel->mutex);
+  return CHANNEL_OK;
+}
+
+// refuse further sends and wake everyone waiting
+void
+channel_close (chan_t *chan)
+{
+  channel_t *channel = chan->channel;
+
+  pthread_mutex_lock(&channel->mutex);
+  channel->closed = 1;
+  pthread_cond_broadcast(&channel->readable);
+  pthread_cond_broadcast(&channel->writable);
+  pthread_mutex_unlock(&channel->mutex);
+}
@@ -0,0 +1,55 @@
+/*
+Copyright (c) 2016 Sean Pringle sean.pringle@gmail.com
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+// Channels are bounded queues of messages between interpreter threads.
+// Any number of threads may send to and receive from the same channel.
+// The queue itself is shared and counted across threads; each interpreter
+// sees it through a chan_t handle of its own, counted like an io_t. The
+// queue is freed once no handle and no message in flight refers to it.
+
+enum {
+  CHANNEL_OK = 0,
+  CHANNEL_FULL,
+  CHANNEL_EMPTY,
+  CHANNEL_CLOSED,
+};
+
+struct channel;
+
+typedef struct {
+  struct channel *channel;
+  int ref_count;
+} chan_t;
+
+chan_t* chan_alloc (struct channel*);
+chan_t* chan_incref (chan_t*);
+chan_t* chan_decref (chan_t*);
+void chan_free_all ();
+
+struct channel* channel_open (int);
+struct channel* channel_hold (struct channel*);
+void channel_release (struct channel*);
+int channel_send (chan_t*, void*, int);
+int channel_recv (chan_t*, void**, int);
+void channel_close (chan_t*);
@@ -0,0 +1,959 @@
+/*
+Copyright (c) 2016 Sean Pringle sean.pringle@gmail.com
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "arena.h"
+#include "op.h"
+#include "str.h"
+#include "vec.h"
+#include "map.h"
+#include "lt.h"
+#include "collect.h"
+#include "io.h"
+#include "sched.h"
+#include "line.h"
+#include "state.h"
+
+// Cycle collection for maps, vecs and coroutines, after Bacon & Rajan,
+// "Concurrent Cycle Collection in Reference Counted Systems".
+//
+// A decref that leaves a container alive buffers it as a possible root.
+// A collection takes the buffer and then, in resumable phases:
+//
+//  ROOTS   drops roots that were incremented or freed since buffering
+//  MARK    traces everything reachable from the roots, copying each
+//          count to crc and subtracting the references found inside
+//  SCAN    marks live anything with crc > 0 and everything below it
+//  SELECT  gathers the rest as candidate garbage
+//  VERIFY  recounts the candidates exactly, keeping the closed set
+//  RELEASE drops what the garbage refers to outside itself
+//  DESTROY frees the garbage
+//  CLEAN   clears the trace bits and releases the roots
+//
+// All but VERIFY run in slices of COLLECT_SLICE objects, and the mutator
+// keeps running in between, so up to VERIFY their results are only a
+// guess. VERIFY runs in one piece: it recomputes internal counts among
+// the candidates from the current graph and real reference counts, so
+// what it keeps is exactly the set nothing outside refers to. Its cost
+// follows the number of candidates rather than the heap. Nothing can
+// reach the garbage after that, so freeing it is sliced again.
+//
+// The mutator runs the slices itself, one at each statement boundary
+// while a collection is in progress, so a pause is bounded by the slice
+// rather than the heap.
+//
+// Reference counting is deferred, after Deutsch & Bobrow: references from
+// coroutine stacks and scopes are not counted, so pushing, popping and
+// passing arguments never touch a count. A container whose last counted
+// or uncounted reference is dropped goes in the zero count table instead
+// of being freed, and reconciliation at a statement boundary frees those
+// no root refers to. The same roots count as outside references when
+// VERIFY judges candidate garbage.
+
+enum {
+  COLLECT_IDLE = 0,
+  COLLECT_ROOTS,
+  COLLECT_MARK,
+  COLLECT_SCAN,
+  COLLECT_SELECT,
+  COLLECT_VERIFY,
+  COLLECT_RELEASE,
+  COLLECT_DESTROY,
+  COLLECT_CLEAN,
+};
+
+static void
+plist_push (plist_t *list, void *ptr)
+{
+  if (list->count == list->limit)
+  {
+    list->limit = list->limit ? list->limit * 2: 1024;
+    list->items = realloc(list->items, sizeof(void*) * list->limit);
+    ensure(list->items) errorf("%s realloc", __func__);
+  }
+  list->items[list->count++] = ptr;
+}
+
+static int
+is_container (void *ptr)
+{
+  return ptr && (is_map(ptr) || is_vec(ptr) || is_cor(ptr));
+}
+
+static unsigned int*
+flags_of (void *ptr)
+{
+  if (is_map(ptr)) return &((map_t*)ptr)->flags;
+  if (is_vec(ptr)) return &((vec_t*)ptr)->flags;
+  return &((cor_t*)ptr)->flags;
+}
+
+static int*
+refs_of (void *ptr)
+{
+  if (is_map(ptr)) return &((map_t*)ptr)->ref_count;
+  if (is_vec(ptr)) return &((vec_t*)ptr)->ref_count;
+  return &((cor_t*)ptr)->ref_count;
+}
+
+static int*
+crc_of (void *ptr)
+{
+  if (is_map(ptr)) return &((map_t*)ptr)->crc;
+  if (is_vec(ptr)) return &((vec_t*)ptr)->crc;
+  return &((cor_t*)ptr)->crc;
+}
+
+typedef void (*childcb)(void*, int);
+
+// call cb for every container referenced by ptr, and whether that
+// reference is counted
+static void
+children (void *ptr, childcb cb)
+{
+  if (is_map(ptr))
+  {
+    map_t *map = ptr;
+    int counted = !(map->flags & MAP_SCOPE);
+
+    if (map->chains) for (int i = 0; i < 17; i++)
+    {
+      for (node_t *node = map->chains[i]; node; node = node->next)
+      {
+        if (is_container(node->key)) cb(node->key, counted);
+        if (is_container(node->val)) cb(node->val, counted);
+      }
+    }
+
+    if (map->meta) cb(map->meta, 1);
+  }
+  else
+  if (is_vec(ptr))
+  {
+    vec_t *vec = ptr;
+    int counted = !(vec->flags & VEC_ROOT);
+
+    for (int i = 0; i < vec->count; i++)
+      if (is_container(vec->items[i])) cb(vec->items[i], counted);
+  }
+  else
+  {
+    cor_t *cor = ptr;
+
+    if (cor->stack) cb(cor->stack, 1);
+    if (cor->other) cb(cor->other, 1);
+    if (cor->scopes) cb(cor->scopes, 1);
+    if (cor->selves) cb(cor->selves, 1);
+  }
+}
+
+typedef void (*rootcb)(cor_t*, void*, void*);
+
+static void
+root_map (cor_t *cor, map_t *map, rootcb cb)
+{
+  for (int i = 0; i < 17; i++)
+  {
+    for (node_t *node = map->chains[i]; node; node = node->next)
+    {
+      cb(cor, map, node->key);
+      cb(cor, map, node->val);
+    }
+  }
+}
+
+static void
+root_vec (cor_t *cor, vec_t *vec, rootcb cb)
+{
+  for (int i = 0; i < vec->count; i++)
+    cb(cor, vec, vec->items[i]);
+}
+
+// call cb for every uncounted reference along with what holds it and the
+// coroutine it belongs to: the running coroutines, then the variables of
+// the global scope and every coroutine's stacks and scopes
+static void
+roots (rootcb cb)
+{
+  for (int i = 0; i < routine_count; i++)
+    cb(NULL, NULL, routines[i]);
+
+  root_map(NULL, scope_global, cb);
+
+  for (cor_t *cor = arena_next(cors, NULL); cor; cor = arena_next(cors, cor))
+  {
+    // a shell, or released garbage
+    if (!cor->stack) continue;
+
+    root_vec(cor, cor->stack, cb);
+    root_vec(cor, cor->other, cb);
+    root_vec(cor, cor->selves, cb);
+    root_vec(cor, cor->scopes, cb);
+
+    for (int i = 0; i < cor->scopes->count; i++)
+      root_map(cor, cor->scopes->items[i], cb);
+  }
+}
+
+// Collect before garbage could fill half of the smallest container arena;
+// the allocators have no safe point to collect at on failure.
+void
+collect_init ()
+{
+  int pages = maps->pages < vecs->pages ? maps->pages: vecs->pages;
+
+  collect_threshold = COLLECT_THRESHOLD;
+
+  if (pages / 2 < collect_threshold)
+    collect_threshold = pages / 2;
+
+  if (collect_threshold < 1)
+    collect_threshold = 1;
+
+  collect_zct_limit = collect_threshold;
+  collect_zct_floor = COLLECT_CROWDED;
+  collect_urge_wait = COLLECT_CROWDED;
+}
+
+void
+collect_root (void *ptr, unsigned int *flags)
+{
+  *flags = (*flags & ~GC_COLOR) | GC_PURPLE;
+
+  if (*flags & GC_BUFFERED)
+    return;
+
+  *flags |= GC_BUFFERED;
+  plist_push(&collect_buffer, ptr);
+}
+
+static int
+half_full (arena_t *arena)
+{
+  return arena->used > arena->pages / 2;
+}
+
+// garbage waiting in the zero count table may be what fills an arena
+static int
+crowded ()
+{
+  return half_full(vecs) || half_full(maps) || half_full(cors);
+}
+
+static int
+nearly_full ()
+{
+  return COLLECT_FULL(vecs) || COLLECT_FULL(maps) || COLLECT_FULL(cors)
+    || COLLECT_FULL(ints) || COLLECT_FULL(dbls) || COLLECT_FULL(strs);
+}
+
+// Only references from containers and C globals are counted. Whoever
+// drops the last reference of either kind queues the container here.
+void
+collect_zero (void *ptr, unsigned int *flags)
+{
+  if (*flags & GC_ZCT)
+    return;
+
+  *flags |= GC_ZCT;
+  plist_push(&collect_zct, ptr);
+
+  if (collect_zct.count >= collect_zct_limit || (collect_zct.count >= collect_zct_floor && crowded()))
+    collect_pending = 1;
+}
+
+int
+collect_count ()
+{
+  return collect_buffer.count + collect_cycle.count;
+}
+
+int
+collect_deferred ()
+{
+  return collect_zct.count;
+}
+
+// a shell was already emptied and counted as destroyed when it was freed
+static void
+free_shell (void *ptr)
+{
+  *flags_of(ptr) = 0;
+
+  if (is_map(ptr)) arena_free(maps, ptr);
+  else if (is_vec(ptr)) arena_free(vecs, ptr);
+  else arena_free(cors, ptr);
+}
+
+// a list lets go of ptr; a shell goes with the last list holding it
+static void
+unlist (void *ptr, unsigned int list)
+{
+  unsigned int *flags = flags_of(ptr);
+  *flags &= ~list;
+
+  if ((*flags & (GC_SHELL|GC_BUFFERED|GC_ZCT)) == GC_SHELL)
+    free_shell(ptr);
+}
+
+static void
+trace (void *ptr)
+{
+  *flags_of(ptr) |= GC_TRACED;
+  *crc_of(ptr) = *refs_of(ptr);
+  plist_push(&collect_traced, ptr);
+  plist_push(&collect_work, ptr);
+}
+
+static void
+mark_edge (void *ptr, int counted)
+{
+  if (!(*flags_of(ptr) & GC_TRACED))
+    trace(ptr);
+
+  if (counted)
+    crc_of(ptr)[0]--;
+}
+
+static void
+live_edge (void *ptr, int counted)
+{
+  unsigned int *flags = flags_of(ptr);
+
+  if ((*flags & (GC_TRACED|GC_LIVE)) == GC_TRACED)
+  {
+    *flags |= GC_LIVE;
+    plist_push(&collect_work, ptr);
+  }
+}
+
+static void
+verify_edge (void *ptr, int counted)
+{
+  if (counted && (*flags_of(ptr) & GC_CANDIDATE))
+    crc_of(ptr)[0]--;
+}
+
+// an uncounted reference from outside the candidates
+static void
+verify_root (cor_t *cor, void *holder, void *ptr)
+{
+  if (holder && (*flags_of(holder) & GC_CANDIDATE))
+    return;
+
+  if (is_container(ptr) && (*flags_of(ptr) & GC_CANDIDATE))
+    crc_of(ptr)[0]++;
+}
+
+static void
+verify_live (void *ptr, int counted)
+{
+  unsigned int *flags = flags_of(ptr);
+
+  if (*flags & GC_CANDIDATE)
+  {
+    *flags &= ~GC_CANDIDATE;
+    plist_push(&collect_work, ptr);
+  }
+}
+
+// references from garbage to garbage vanish with it; anything else is
+// released normally
+static void
+drop (void *ptr, int counted)
+{
+  if (!is_container(ptr) || !(*flags_of(ptr) & GC_CANDIDATE))
+    discard(counted ? unstore(ptr): ptr);
+}
+
+static void
+release (void *ptr)
+{
+  if (is_map(ptr))
+  {
+    map_t *map = ptr;
+    int counted = !(map->flags & MAP_SCOPE);
+
+    for (int i = 0; i < 17; i++)
+    {
+      while (map->chains[i])
+      {
+        node_t *node = map->chains[i];
+        drop(node->key, counted);
+        drop(node->val, counted);
+        map->chains[i] = node->next;
+        arena_free(nodes, node);
+      }
+    }
+
+    if (map->meta) drop(map->meta, 1);
+    heap_free(map->chains);
+    map->chains = NULL;
+    map->meta = NULL;
+  }
+  else
+  if (is_vec(ptr))
+  {
+    vec_t *vec = ptr;
+
+    for (int i = 0; i < vec->count; i++)
+    {
+      void *item = vec->items[i];
+
+      if (!(vec->flags & VEC_SCOPES))
+        drop(item, !(vec->flags & VEC_ROOT));
+      else
+      if (!(*flags_of(item) & GC_CANDIDATE))
+        map_unscope(item);
+    }
+
+    heap_free(vec->items);
+    vec->items = NULL;
+    vec->count = 0;
+  }
+  else
+  {
+    cor_t *cor = ptr;
+    drop(cor->stack, 1);
+    drop(cor->other, 1);
+    drop(cor->selves, 1);
+    drop(cor->scopes, 1);
+    cor->stack = cor->other = cor->selves = cor->scopes = NULL;
+    ivec_empty(&cor->calls);
+    ivec_empty(&cor->loops);
+    ivec_empty(&cor->marks);
+  }
+}
+
+// a listed object stays behind as a shell for its list to free
+static void
+destroy (void *ptr)
+{
+  unsigned int listed = *flags_of(ptr) & (GC_BUFFERED|GC_ZCT);
+
+  if (is_map(ptr))
+  {
+    memset(ptr, 0, sizeof(map_t));
+    if (!listed) arena_free(maps, ptr);
+    map_count--;
+    map_destroyed++;
+  }
+  else
+  if (is_vec(ptr))
+  {
+    memset(ptr, 0, sizeof(vec_t));
+    if (!listed) arena_free(vecs, ptr);
+    vec_count--;
+    vec_destroyed++;
+  }
+  else
+  {
+    memset(ptr, 0, sizeof(cor_t));
+    if (!listed) arena_free(cors, ptr);
+    cor_count--;
+    cor_destroyed++;
+  }
+
+  if (listed)
+    *flags_of(ptr) = listed|GC_SHELL;
+}
+
+static void
+begin ()
+{
+  plist_t cycle = collect_cycle;
+  collect_cycle = collect_buffer;
+  collect_buffer = cycle;
+  collect_buffer.count = 0;
+
+  collect_phase = COLLECT_ROOTS;
+  collect_cursor = 0;
+  collect_kept = 0;
+  collect_allocs = 0;
+}
+
+static int
+step_roots (int budget)
+{
+  while (budget > 0 && collect_cursor < collect_cycle.count)
+  {
+    void *obj = collect_cycle.items[collect_cursor++];
+    unsigned int *flags = flags_of(obj);
+    budget--;
+
+    if ((*flags & (GC_SHELL|GC_COLOR)) == GC_PURPLE && *refs_of(obj) > 0)
+    {
+      // a decrement during the collection turns it purple again
+      *flags &= ~GC_COLOR;
+      if (!(*flags & GC_TRACED)) trace(obj);
+      collect_cycle.items[collect_kept++] = obj;
+      continue;
+    }
+
+    unlist(obj, GC_BUFFERED);
+  }
+
+  if (collect_cursor == collect_cycle.count)
+  {
+    collect_cycle.count = collect_kept;
+    collect_phase = COLLECT_MARK;
+  }
+  return budget;
+}
+
+static int
+step_mark (int budget)
+{
+  while (budget > 0 && collect_work.count)
+  {
+    void *obj = collect_work.items[--collect_work.count];
+
+    // freed since it was queued
+    if (!(*flags_of(obj) & GC_TRACED)) continue;
+
+    children(obj, mark_edge);
+    budget--;
+  }
+
+  if (!collect_work.count)
+  {
+    collect_phase = COLLECT_SCAN;
+    collect_cursor = 0;
+  }
+  return budget;
+}
+
+static int
+step_scan (int budget)
+{
+  while (budget > 0)
+  {
+    if (collect_work.count)
+    {
+      void *obj = collect_work.items[--collect_work.count];
+      if (*flags_of(obj) & GC_TRACED) children(obj, live_edge);
+      budget--;
+      continue;
+    }
+
+    if (collect_cursor == collect_traced.count)
+    {
+      collect_phase = COLLECT_SELECT;
+      collect_cursor = 0;
+      break;
+    }
+
+    void *obj = collect_traced.items[collect_cursor++];
+    unsigned int *flags = flags_of(obj);
+
+    if ((*flags & (GC_TRACED|GC_LIVE)) == GC_TRACED && *crc_of(obj) > 0)
+    {
+      *flags |= GC_LIVE;
+      plist_push(&collect_work, obj);
+    }
+  }
+  return budget;
+}
+
+static int
+step_select (int budget)
+{
+  while (budget > 0 && collect_cursor < collect_traced.count)
+  {
+    void *obj = collect_traced.items[collect_cursor++];
+    unsigned int *flags = flags_of(obj);
+    budget--;
+
+    if ((*flags & (GC_TRACED|GC_LIVE|GC_CANDIDATE)) == GC_TRACED)
+    {
+      *flags |= GC_CANDIDATE;
+      plist_push(&collect_cands, obj);
+    }
+  }
+
+  if (collect_cursor == collect_traced.count)
+    collect_phase = COLLECT_VERIFY;
+  return budget;
+}
+
+// must not be interrupted: works from real counts on the current graph
+static int
+step_verify (int budget)
+{
+  plist_t *cands = &collect_cands;
+  int kept = 0;
+
+  // a slot freed and reused since selection may appear twice; GC_LIVE
+  // marks the first occurrence
+  for (int i = 0; i < cands->count; i++)
+  {
+    void *obj = cands->items[i];
+    unsigned int *flags = flags_of(obj);
+
+    if ((*flags & (GC_CANDIDATE|GC_LIVE)) != GC_CANDIDATE) continue;
+
+    *flags |= GC_LIVE;
+    *crc_of(obj) = *refs_of(obj);
+    cands->items[kept++] = obj;
+  }
+
+  cands->count = kept;
+
+  for (int i = 0; i < cands->count; i++)
+    *flags_of(cands->items[i]) &= ~GC_LIVE;
+
+  for (int i = 0; i < cands->count; i++)
+    children(cands->items[i], verify_edge);
+
+  roots(verify_root);
+
+  for (int i = 0; i < cands->count; i++)
+  {
+    void *obj = cands->items[i];
+
+    if (!(*flags_of(obj) & GC_CANDIDATE) || *crc_of(obj) <= 0)
+      continue;
+
+    verify_live(obj, 1);
+
+    while (collect_work.count)
+      children(collect_work.items[--collect_work.count], verify_live);
+  }
+
+  kept = 0;
+
+  for (int i = 0; i < cands->count; i++)
+    if (*flags_of(cands->items[i]) & GC_CANDIDATE) cands->items[kept++] = cands->items[i];
+
+  cands->count = kept;
+
+  collect_phase = COLLECT_RELEASE;
+  collect_cursor = 0;
+  return budget - cands->count;
+}
+
+// garbage keeps GC_CANDIDATE until every member is released
+static int
+step_release (int budget)
+{
+  while (budget > 0 && collect_cursor < collect_cands.count)
+  {
+    release(collect_cands.items[collect_cursor++]);
+    budget--;
+  }
+
+  if (collect_cursor == collect_cands.count)
+  {
+    collect_phase = COLLECT_DESTROY;
+    collect_cursor = 0;
+  }
+  return budget;
+}
+
+static int
+step_destroy (int budget)
+{
+  while (budget > 0 && collect_cursor < collect_cands.count)
+  {
+    destroy(collect_cands.items[collect_cursor++]);
+    collect_freed++;
+    budget--;
+  }
+
+  if (collect_cursor == collect_cands.count)
+  {
+    collect_cands.count = 0;
+    collect_phase = COLLECT_CLEAN;
+    collect_cursor = 0;
+    collect_kept = 0;
+  }
+  return budget;
+}
+
+static int
+step_clean (int budget)
+{
+  while (budget > 0 && collect_cursor < collect_traced.count)
+  {
+    void *obj = collect_traced.items[collect_cursor++];
+    *flags_of(obj) &= ~(GC_TRACED|GC_LIVE|GC_CANDIDATE);
+    budget--;
+  }
+
+  // release the roots; anything that went purple again is re-buffered
+  while (budget > 0 && collect_kept < collect_cycle.count)
+  {
+    void *obj = collect_cycle.items[collect_kept++];
+    unsigned int *flags = flags_of(obj);
+    budget--;
+
+    if (*flags & GC_SHELL)
+    {
+      unlist(obj, GC_BUFFERED);
+      continue;
+    }
+
+    *flags &= ~GC_BUFFERED;
+
+    if ((*flags & GC_COLOR) == GC_PURPLE && *refs_of(obj) > 0)
+      collect_root(obj, flags);
+  }
+
+  if (collect_kept < collect_cycle.count)
+    return budget;
+
+  collect_traced.count = 0;
+  collect_cycle.count = 0;
+  collect_phase = COLLECT_IDLE;
+  collect_runs++;
+  return budget;
+}
+
+static int64_t
+micros ()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// run phases until the budget is spent or the collection finishes; the
+// caller owns the world
+static void
+slice (int budget)
+{
+  int64_t start = micros();
+
+  while (collect_phase != COLLECT_IDLE && budget > 0)
+  {
+    switch (collect_phase)
+    {
+      case COLLECT_ROOTS: budget = step_roots(budget); break;
+      case COLLECT_MARK: budget = step_mark(budget); break;
+      case COLLECT_SCAN: budget = step_scan(budget); break;
+      case COLLECT_SELECT: budget = step_select(budget); break;
+      case COLLECT_VERIFY: budget = step_verify(budget); break;
+      case COLLECT_RELEASE: budget = step_release(budget); break;
+      case COLLECT_DESTROY: budget = step_destroy(budget); break;
+      case COLLECT_CLEAN: budget = step_clean(budget); break;
+    }
+  }
+
+  int64_t pause = micros() - start;
+
+  collect_slices++;
+  collect_pause_last = pause;
+  collect_pause_total += pause;
+
+  if (pause > collect_pause_max)
+    collect_pause_max = pause;
+}
+
+// A suspended coroutine keeping a zero count entry alive may itself be
+// garbage held up only by a cycle, and nothing else would ever offer it
+// to the cycle collector: its stack and scope references are uncounted,
+// and the references to it may never be decremented. Buffer it as a
+// possible root so the next collection decides.
+static void
+rooted (cor_t *cor, void *holder, void *ptr)
+{
+  if (!is_container(ptr) || !(*flags_of(ptr) & GC_ZCT))
+    return;
+
+  *flags_of(ptr) |= GC_ROOTED;
+
+  if (cor && cor->state != COR_RUNNING && cor->ref_count > 0 && !(cor->flags & GC_BUFFERED))
+    collect_root(cor, &cor->flags);
+}
+
+static void
+reclaim (void *ptr)
+{
+  if (is_map(ptr)) map_free(ptr);
+  else if (is_vec(ptr)) vec_free(ptr);
+  else cor_free(ptr);
+}
+
+// Free everything in the zero count table that is still at zero and that
+// no root refers to. The caller owns the world at a statement boundary.
+// What freeing drops to zero waits for the next reconciliation, since the
+// roots were only marked for the entries already there.
+void
+collect_reconcile ()
+{
+  int64_t start = micros();
+
+  roots(rooted);
+
+  int count = collect_zct.count;
+  int kept = 0;
+
+  for (int i = 0; i < count; i++)
+  {
+    void *obj = collect_zct.items[i];
+    unsigned int *flags = flags_of(obj);
+
+    if (*flags & GC_SHELL)
+    {
+      unlist(obj, GC_ZCT);
+      continue;
+    }
+
+    if (*refs_of(obj) > 0)
+    {
+      *flags &= ~(GC_ZCT|GC_ROOTED);
+      continue;
+    }
+
+    // still referenced, or garbage the cycle collector has claimed
+    if (*flags & (GC_ROOTED|GC_CANDIDATE))
+    {
+      *flags &= ~GC_ROOTED;
+      collect_zct.items[kept++] = obj;
+      continue;
+    }
+
+    *flags &= ~GC_ZCT;
+    reclaim(obj);
+    collect_reclaimed++;
+  }
+
+  if (collect_zct.count > count)
+    memmove(&collect_zct.items[kept], &collect_zct.items[count], (collect_zct.count - count) * sizeof(void*));
+  collect_zct.count = kept + collect_zct.count - count;
+  collect_zct_limit = collect_zct.count + collect_threshold;
+  collect_zct_floor = collect_zct.count + COLLECT_CROWDED;
+  collect_reconciles++;
+
+  int64_t pause = micros() - start;
+
+  collect_pause_last = pause;
+  collect_pause_total += pause;
+
+  if (pause > collect_pause_max)
+    collect_pause_max = pause;
+}
+
+static void
+finish ()
+{
+  while (collect_phase != COLLECT_IDLE)
+    slice(INT32_MAX);
+}
+
+// drop the collector's lists; the heap they point into is going away
+void
+collect_close ()
+{
+  plist_t *lists[] = { &collect_buffer, &collect_cycle, &collect_zct, &collect_traced, &collect_work, &collect_cands };
+
+  for (int i = 0; i < sizeof(lists) / sizeof(plist_t*); i++)
+  {
+    free(lists[i]->items);
+    memset(lists[i], 0, sizeof(plist_t));
+  }
+}
+
+// statement boundary: no C code holds uncounted references
+void
+collect_safepoint ()
+{
+  collect_pending = 0;
+
+  if (collect_phase != COLLECT_IDLE)
+  {
+    slice(COLLECT_SLICE);
+    collect_pending = collect_phase != COLLECT_IDLE;
+  }
+
+  if (collect_urgent)
+  {
+    collect_urgent = 0;
+    collect();
+
+    // live data filled the arena, so urging again soon won't help
+    if (nearly_full())
+      collect_urge_wait = collect_urge_wait < collect_threshold ? collect_urge_wait * 2: collect_threshold;
+    else
+      collect_urge_wait = COLLECT_CROWDED;
+
+    return;
+  }
+
+  if (collect_zct.count >= collect_zct_limit || (collect_zct.count >= collect_zct_floor && crowded()))
+    collect_reconcile();
+
+  if (collect_phase != COLLECT_IDLE)
+  {
+    // a whole threshold was allocated during one collection; catch up
+    if (collect_allocs < collect_threshold)
+      return;
+
+    finish();
+  }
+
+  if (collect_allocs < collect_threshold)
+    return;
+
+  begin();
+  collect_pending = 1;
+}
+
+// An allocator found its arena nearly full. The slices may be too far
+// behind, or the garbage may be waiting in the zero count table, so the
+// next statement boundary runs a whole collection instead.
+void
+collect_urge ()
+{
+  if (collect_urgent || ++collect_urges < collect_urge_wait)
+    return;
+
+  collect_urges = 0;
+  collect_urgent = 1;
+  collect_pending = 1;
+}
+
+// finish any collection in progress, then free everything unreachable;
+// returns the number of objects freed in cycles
+int
+collect ()
+{
+  int freed = collect_freed;
+
+  finish();
+  collect_reconcile();
+  begin();
+  finish();
+  collect_reconcile();
+
+  return collect_freed - freed;
+}
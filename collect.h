@@ -0,0 +1,71 @@
+/*
+Copyright (c) 2016 Sean Pringle sean.pringle@gmail.com
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// Collector state, kept in the high bits of map_t, vec_t and cor_t flags.
+// Purple marks a possible cycle root since its last increment; buffered
+// means it sits in a root buffer, zct that it sits in the zero count
+// table. A shell is an object already freed that one of those lists
+// still holds. The remaining bits belong to a running collection or
+// reconciliation.
+#define GC_BLACK (0)
+#define GC_PURPLE (1<<28)
+#define GC_COLOR (1<<28)
+#define GC_BUFFERED (1<<30)
+#define GC_ZCT (1<<29)
+#define GC_SHELL (1<<25)
+#define GC_TRACED (1u<<31)
+#define GC_LIVE (1<<27)
+#define GC_CANDIDATE (1<<26)
+#define GC_ROOTED (1<<24)
+#define GC_MASK (GC_COLOR|GC_BUFFERED|GC_ZCT|GC_SHELL|GC_TRACED|GC_LIVE|GC_CANDIDATE|GC_ROOTED)
+
+// upper bound on container allocations between automatic collections
+#define COLLECT_THRESHOLD 10000
+
+// once a container arena is half full, reconcile after this many more
+// zero count entries instead of waiting for the threshold
+#define COLLECT_CROWDED 64
+
+// an arena this full asks for a whole collection at the next statement boundary
+#define COLLECT_FULL(arena) ((arena)->used > (arena)->pages - (arena)->pages / 4)
+
+// objects visited per slice of an incremental collection
+#define COLLECT_SLICE 1024
+
+// a growable list of objects the collector is tracking
+typedef struct {
+  void **items;
+  int count;
+  int limit;
+} plist_t;
+
+void collect_init ();
+void collect_close ();
+void collect_root (void*, unsigned int*);
+void collect_zero (void*, unsigned int*);
+void collect_reconcile ();
+void collect_safepoint ();
+void collect_urge ();
+int collect_count ();
+int collect_deferred ();
+int collect ();
@@ -0,0 +1,395 @@
+/*
+Copyright (c) 2016 Sean Pringle sean.pringle@gmail.com
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "arena.h"
+#include "op.h"
+#include "str.h"
+#include "vec.h"
+#include "map.h"
+#include "lt.h"
+#include "collect.h"
+#include "io.h"
+#include "sched.h"
+#include "ring.h"
+#include "line.h"
+#include "state.h"
+
+io_t*
+io_alloc (int fd)
+{
+  io_count++;
+  io_created++;
+  io_t *io = arena_alloc(ios, sizeof(io_t));
+
+  ensure(io)
+  {
+    stacktrace();
+    errorf("arena_alloc ios");
+  }
+  memset(io, 0, sizeof(io_t));
+
+  // the read buffer comes with the first read, so writers need none
+  io->fd = fd;
+  io->limit = IO_BUFFER;
+
+  // a small file needs no more buffer than it has bytes, which matters
+  // when thousands are open at once
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+  {
+    io->flags |= IO_FILE;
+
+    if (st.st_size < IO_BUFFER)
+      io->limit = st.st_size < IO_PACKET ? IO_PACKET: st.st_size + 1;
+  }
+
+  return io;
+}
+
+io_t*
+io_open (char *path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return NULL;
+
+  io_t *io = io_alloc(fd);
+  io->flags |= IO_CLOSE;
+  return io;
+}
+
+static void
+ensure_io (io_t *io, const char *func)
+{
+  ensure(is_io(io)) errorf("%s not an io_t", func);
+}
+
+io_t*
+io_incref (io_t *io)
+{
+  ensure_io(io, __func__);
+
+  io->ref_count++;
+  return io;
+}
+
+io_t*
+io_decref (io_t *io)
+{
+  ensure_io(io, __func__);
+
+  if (--io->ref_count == 0)
+  {
+    if (io->flags & IO_CLOSE)
+    {
+      sched_close(io->fd);
+      close(io->fd);
+    }
+    if (io->buffer)
+      heap_free(io->buffer);
+    memset(io, 0, sizeof(io_t));
+    arena_free(ios, io);
+    io_count--;
+    io_destroyed++;
+    io = NULL;
+  }
+  return io;
+}
+
+// wait until fd is ready, with the collector free to run meanwhile
+static void
+io_poll (int fd, short events)
+{
+  struct pollfd pfd = { .fd = fd, .events = events };
+
+  while (poll(&pfd, 1, -1) < 0 && errno == EINTR);
+}
+
+// would this block? a scheduled task parks instead of finding out, and
+// a non-blocking descriptor will say so itself
+static int
+io_blocked (io_t *io, short events)
+{
+  struct pollfd pfd = { .fd = io->fd, .events = events };
+  return sched_task() && !(io->flags & IO_NONBLOCK) && poll(&pfd, 1, 0) == 0;
+}
+
+// refill the buffer with one large read, keeping unconsumed bytes;
+// returns -1 with IO_WAIT set when a task would block
+static int
+io_fill (io_t *io)
+{
+  if (io->flags & IO_EOF) return 0;
+
+  // the kernel owns the buffer until a queued read completes
+  if (io->flags & IO_QUEUED)
+  {
+    io->flags |= IO_WAIT;
+    return -1;
+  }
+
+  if (!io->buffer)
+    io->buffer = heap_alloc(io->limit);
+
+  if (io->start)
+  {
+    memmove(io->buffer, &io->buffer[io->start], io->length - io->start);
+    io->length -= io->start;
+    io->start = 0;
+  }
+
+  if (io->length == io->limit)
+  {
+    io->limit += IO_BUFFER;
+    io->buffer = heap_realloc(io->buffer, io->limit);
+  }
+
+  for (;;)
+  {
+    int bytes;
+
+    // a ring read finished while the task was parked
+    if (io->flags & IO_DONE)
+    {
+      io->flags &= ~IO_DONE;
+      bytes = io->result;
+    }
+    else
+    if ((io->flags & IO_FILE) && sched_task()
+      && ring_read(io, &io->buffer[io->length], io->limit - io->length) == 0)
+    {
+      io->flags |= IO_WAIT;
+      return -1;
+    }
+    else
+    {
+      if (io_blocked(io, POLLIN))
+      {
+        io->flags |= IO_WAIT;
+        return -1;
+      }
+
+      bytes = read(io->fd, &io->buffer[io->length], io->limit - io->length);
+
+      if (bytes < 0 && errno == EINTR)
+        continue;
+
+      if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      {
+        if (sched_task())
+        {
+          io->flags |= IO_WAIT;
+          return -1;
+        }
+        io_poll(io->fd, POLLIN);
+        continue;
+      }
+    }
+
+    if (bytes <= 0)
+    {
+      io->flags |= IO_EOF;
+      return 0;
+    }
+
+    io->length += bytes;
+    return bytes;
+  }
+}
+
+char*
+io_line (io_t *io)
+{
+  ensure_io(io, __func__);
+  io->flags &= ~IO_WAIT;
+
+  for (;;)
+  {
+    char *start = &io->buffer[io->start];
+    char *lf = io->buffer ? memchr(start, '\n', io->length - io->start): NULL;
+
+    if (lf)
+    {
+      char *line = substr(start, 0, lf - start);
+      io->start += lf - start + 1;
+      return line;
+    }
+
+    int bytes = io_fill(io);
+
+    if (bytes < 0)
+      return NULL;
+
+    if (!bytes)
+    {
+      if (io->start == io->length) return NULL;
+
+      char *line = substr(io->buffer, io->start, io->length - io->start);
+      io->start = io->length;
+      return line;
+    }
+  }
+}
+
+char*
+io_read (io_t *io, int bytes)
+{
+  ensure_io(io, __func__);
+  io->flags &= ~IO_WAIT;
+
+  int filled = 1;
+
+  while (io->length - io->start < bytes && (filled = io_fill(io)) > 0);
+
+  if (filled < 0)
+    return NULL;
+
+  if (io->start == io->length) return NULL;
+
+  if (bytes > io->length - io->start)
+    bytes = io->length - io->start;
+
+  char *str = substr(io->buffer, io->start, bytes);
+  io->start += bytes;
+  return str;
+}
+
+// Write all of data, or as much as a task can before it would block, in
+// which case IO_WAIT is set and the call must be repeated with the same
+// data; io->sent remembers the progress. Returns the bytes written in
+// total, or -1 on error.
+int
+io_write (io_t *io, char *data, int length)
+{
+  ensure_io(io, __func__);
+  io->flags &= ~IO_WAIT;
+
+  while (io->sent < length)
+  {
+    if (io_blocked(io, POLLOUT))
+    {
+      io->flags |= IO_WAIT;
+      return io->sent;
+    }
+
+    int bytes = write(io->fd, &data[io->sent], length - io->sent);
+
+    if (bytes < 0 && errno == EINTR)
+      continue;
+
+    if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+      if (sched_task())
+      {
+        io->flags |= IO_WAIT;
+        return io->sent;
+      }
+      io_poll(io->fd, POLLOUT);
+      continue;
+    }
+
+    if (bytes < 0)
+    {
+      io->sent = 0;
+      return -1;
+    }
+
+    io->sent += bytes;
+  }
+
+  io->sent = 0;
+  return length;
+}
+
+// park the running task after IO_WAIT, until io can make progress
+void
+io_park (io_t *io, int writing)
+{
+  if (io->flags & IO_QUEUED)
+  {
+    ensure(!io->waiter)
+      errorf("fd %d: another task is already waiting to read", io->fd);
+
+    io->waiter = sched_suspend();
+    return;
+  }
+  sched_park(io->fd, writing);
+}
+
+// a connected pair of non-blocking descriptors, each closed with its io;
+// there may be thousands, so their buffers start small
+static void
+io_pair (io_t **pair, int *fds)
+{
+  for (int i = 0; i < 2; i++)
+  {
+    fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+    pair[i] = io_alloc(fds[i]);
+    pair[i]->flags |= IO_CLOSE|IO_NONBLOCK;
+    pair[i]->limit = IO_PACKET;
+  }
+}
+
+// pair[0] reads what pair[1] writes
+int
+io_pipe (io_t **pair)
+{
+  int fds[2];
+  if (pipe(fds) < 0) return -1;
+  io_pair(pair, fds);
+  return 0;
+}
+
+int
+io_socketpair (io_t **pair)
+{
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) return -1;
+  io_pair(pair, fds);
+  return 0;
+}
+
+// close the descriptors of any io still alive when an interpreter closes
+void
+io_close_all ()
+{
+  for (io_t *io = arena_next(ios, NULL); io; io = arena_next(ios, io))
+  {
+    if (io->flags & IO_CLOSE)
+      close(io->fd);
+  }
+}
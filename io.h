@@ -0,0 +1,63 @@
+/*
+Copyright (c) 2016 Sean Pringle sean.pringle@gmail.com
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#define IO_BUFFER (64*KB)
+#define IO_PACKET (4*KB)
+
+#define IO_EOF (1<<0)
+#define IO_CLOSE (1<<1)
+// the last read or write would have blocked a task; nothing was lost and
+// the same call can be made again once the descriptor is ready
+#define IO_WAIT (1<<2)
+#define IO_NONBLOCK (1<<3)
+// a regular file, whose reads a task may hand to io_uring; a queued read
+// is in the ring, a done one has its result waiting
+#define IO_FILE (1<<4)
+#define IO_QUEUED (1<<5)
+#define IO_DONE (1<<6)
+
+typedef struct {
+  char *buffer;
+  int start;
+  int length;
+  int limit;
+  int fd;
+  int sent;
+  int result;
+  int flags;
+  int ref_count;
+  void *waiter;
+} io_t;
+
+io_t* io_alloc (int);
+io_t* io_open (char*);
+io_t* io_incref (io_t*);
+io_t* io_decref (io_t*);
+char* io_line (io_t*);
+char* io_read (io_t*, int);
+int io_write (io_t*, char*, int);
+void io_park (io_t*, int);
+int io_pipe (io_t**);
+int io_socketpair (io_t**);
+void io_close_all ();
+
@@ -0,0 +1,205 @@
+/*
+Copyright (c) 2016 Sean Pringle sean.pringle@gmail.com
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "arena.h"
+#include "op.h"
+#include "str.h"
+#include "vec.h"
+#include "map.h"
+#include "lt.h"
+#include "line.h"
+#include "collect.h"
+#include "io.h"
+#include "sched.h"
+#include "state.h"
+
+// The table is a byte stream of entries, one per change of position:
+// varint ip delta, zigzag varint line delta, varint column. An entry
+// covers every instruction up to the next entry's ip. A checkpoint every
+// LINE_STRIDE entries holds the decoder state before that entry, so
+// lookups binary search the checkpoints and decode a short run.
+
+#define LINE_STRIDE 32
+
+static void
+line_byte (int byte)
+{
+  if (line_bytes == line_limit)
+  {
+    line_limit += 1024;
+    line_table = realloc(line_table, line_limit);
+    ensure(line_table) errorf("%s realloc", __func__);
+  }
+  line_table[line_bytes++] = byte;
+}
+
+static void
+line_varint (uint32_t n)
+{
+  while (n >= 0x80)
+  {
+    line_byte((n & 0x7f) | 0x80);
+    n >>= 7;
+  }
+  line_byte(n);
+}
+
+static uint32_t
+line_varint_get (unsigned char *table, int bytes, int *offset)
+{
+  uint32_t n = 0;
+  int shift = 0;
+
+  while (*offset < bytes)
+  {
+    int byte = table[(*offset)++];
+    n |= (uint32_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) break;
+    shift += 7;
+  }
+  return n;
+}
+
+// advance state over the entry at offset
+static int
+line_decode (unsigned char *table, int bytes, int offset, line_state_t *state)
+{
+  state->ip += line_varint_get(table, bytes, &offset);
+  uint32_t zigzag = line_varint_get(table, bytes, &offset);
+  state->line += (int)(zigzag >> 1) ^ -(int)(zigzag & 1);
+  state->column = line_varint_get(table, bytes, &offset);
+  return offset;
+}
+
+// instructions from ip onward came from line:column. Marks arrive in ip
+// order; a later mark at the same ip replaces the earlier one, which lets
+// nested expressions claim the first instruction they emit.
+void
+line_mark (int ip, int line, int column)
+{
+  if (line_entries && line_last.line == line && line_last.column == column)
+    return;
+
+  if (line_entries && ip <= line_last.ip)
+  {
+    line_bytes = line_last.offset;
+    line_entries--;
+
+    if (line_entries % LINE_STRIDE == 0)
+      line_point_count--;
+
+    line_last = line_prev;
+    ip = ip < line_last.ip ? line_last.ip: ip;
+  }
+
+  if (line_entries % LINE_STRIDE == 0)
+  {
+    if (line_point_count == line_point_limit)
+    {
+      line_point_limit += 64;
+      line_points = realloc(line_points, sizeof(line_state_t) * line_point_limit);
+      ensure(line_points) errorf("%s realloc", __func__);
+    }
+    line_points[line_point_count] = line_last;
+    line_points[line_point_count++].offset = line_bytes;
+  }
+
+  line_prev = line_last;
+
+  int delta = line - line_last.line;
+
+  line_last.offset = line_bytes;
+  line_varint(ip - line_last.ip);
+  line_varint(((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+  line_varint(column);
+
+  line_last.ip = ip;
+  line_last.line = line;
+  line_last.column = column;
+  line_entries++;
+}
+
+int
+line_find (int ip, int *line, int *column)
+{
+  int lo = 0, hi = line_point_count;
+
+  while (hi - lo > 1)
+  {
+    int mid = (lo + hi) / 2;
+    if (line_points[mid].ip <= ip) lo = mid; else hi = mid;
+  }
+
+  if (!line_point_count || line_points[lo].ip > ip)
+    return 0;
+
+  line_state_t state = line_points[lo];
+
+  for (int offset = state.offset; offset < line_bytes; )
+  {
+    line_state_t next = state;
+    int after = line_decode(line_table, line_bytes, offset, &next);
+
+    if (next.ip > ip)
+      break;
+
+    state = next;
+    offset = after;
+  }
+
+  if (!state.line)
+    return 0;
+
+  if (line) *line = state.line;
+  if (column) *column = state.column;
+  return 1;
+}
+
+// rebuild from a saved table, eg from the bytecode cache
+void
+line_load (unsigned char *table, int bytes)
+{
+  line_bytes = 0;
+  line_entries = 0;
+  line_point_count = 0;
+  memset(&line_last, 0, sizeof(line_state_t));
+  memset(&line_prev, 0, sizeof(line_state_t));
+
+  line_state_t state;
+  memset(&state, 0, sizeof(line_state_t));
+
+  for (int offset = 0; offset < bytes; )
+  {
+    offset = line_decode(table, bytes, offset, &state);
+    line_mark(state.ip, state.line, state.column);
+  }
+}
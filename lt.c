@@ -33,6 +33,8 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <math.h>
 #include <float.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
+#include <pthread.h>
 #include <pcre.h>
 
 #include "arena.h"
@@ -42,64 +44,28 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "map.h"
 #include "parse.h"
 #include "lt.h"
+#include "collect.h"
+#include "io.h"
+#include "cache.h"
+#include "profile.h"
+#include "line.h"
+#include "sched.h"
+#include "ring.h"
+#include "parallel.h"
+#include "channel.h"
+#include "state.h"
+
+__thread lt_state *lt;
+
+static int true_value = 1;
+static int false_value = 0;
+
+void *bool_true = &true_value;
+void *bool_false = &false_value;
 
-arena_t *heap;
-arena_t *ints;
-arena_t *dbls;
-arena_t *strs;
-arena_t *vecs;
-arena_t *maps;
-arena_t *cors;
-arena_t *subs;
-
-int int_count;
-int int_created;
-int int_destroyed;
-int dbl_count;
-int dbl_created;
-int dbl_destroyed;
-int str_count;
-int str_created;
-int str_destroyed;
-int vec_count;
-int vec_created;
-int vec_destroyed;
-int map_count;
-int map_created;
-int map_destroyed;
-int cor_count;
-int cor_created;
-int cor_destroyed;
-int sub_count;
-int sub_created;
-int sub_destroyed;
-
-int heap_mem;
-int ints_mem;
-int dbls_mem;
-int strs_mem;
-int vecs_mem;
-int maps_mem;
-int cors_mem;
-int subs_mem;
-
-map_t *scope_core;
-map_t *scope_global;
-map_t *super_str;
-map_t *super_vec;
-map_t *super_map;
-
-cor_t **routines;
-int routine_count;
-int routine_limit;
-
-code_t *code;
-int code_count;
-int code_limit;
-FILE *stream_output;
 int func_count = OP_CUSTOM;
 
-func_t funcs[1024] = {
+func_t funcs[FUNC_LIMIT] = {
   [OP_NOP] = { .name = "nop", .func = op_nop },
   [OP_PRINT] = { .name = "print", .func = op_print },
   [OP_COROUTINE] = { .name = "coroutine", .func = op_coroutine },
@@ -148,6 +114,7 @@ func_t funcs[1024] = {
   [OP_FIND] = { .name = "find", .func = op_find },
   [OP_FIND_LIT] = { .name = "find_lit", .func = op_find_lit },
   [OP_SET] = { .name = "set", .func = op_set },
+  [OP_SET_LIT] = { .name = "set_lit", .func = op_set_lit },
   [OP_GET] = { .name = "get", .func = op_get },
   [OP_GET_LIT] = { .name = "get_lit", .func = op_get_lit },
   [OP_INHERIT] = { .name = "inherit", .func = op_inherit },
@@ -171,19 +138,68 @@ func_t funcs[1024] = {
   [OP_COUNT] = { .name = "count", .func = op_count },
   [OP_MATCH] = { .name = "match", .func = op_match },
   [OP_STATUS] = { .name = "status", .func = op_status },
+  [OP_FLUSH] = { .name = "flush", .func = op_flush },
+  [OP_MMAP] = { .name = "mmap", .func = op_mmap },
+  [OP_READ] = { .name = "read", .func = op_read },
+  [OP_LINES] = { .name = "lines", .func = op_lines },
+  [OP_COLLECT] = { .name = "collect", .func = op_collect },
+  [OP_WRITE] = { .name = "write", .func = op_write },
+  [OP_PIPE] = { .name = "pipe", .func = op_pipe },
+  [OP_SOCKETPAIR] = { .name = "socketpair", .func = op_socketpair },
+  [OP_SPAWN] = { .name = "spawn", .func = op_spawn },
+  [OP_RUN] = { .name = "run", .func = op_run },
+  [OP_THREAD] = { .name = "thread", .func = op_thread },
+  [OP_JOIN] = { .name = "join", .func = op_join },
+  [OP_CHANNEL] = { .name = "channel", .func = op_channel },
+  [OP_SEND] = { .name = "send", .func = op_send },
+  [OP_TRY_SEND] = { .name = "try_send", .func = op_try_send },
+  [OP_RECV] = { .name = "recv", .func = op_recv },
+  [OP_TRY_RECV] = { .name = "try_recv", .func = op_try_recv },
+  [OP_CLOSE] = { .name = "close", .func = op_close },
+  [OP_PARALLEL_MAP] = { .name = "parallel_map", .func = op_parallel_map },
+  [OP_PARALLEL_REDUCE] = { .name = "parallel_reduce", .func = op_parallel_reduce },
 };
 
 struct wrapper wrappers[] = {
-  { .library = &scope_core, .op = OP_STATUS,  .results = 1, .name = "status" },
-  { .library = &scope_core, .op = OP_PRINT,   .results = 0, .name = "print" },
-  { .library = &scope_core, .op = OP_INHERIT, .results = 1, .name = "inherit" },
-  { .library = &scope_core, .op = OP_KEYS,    .results = 1, .name = "keys" },
-  { .library = &scope_core, .op = OP_VALUES,  .results = 1, .name = "values" },
+  { .library = NULL,     .op = OP_STATUS,  .results = 1, .name = "status" },
+  { .library = NULL,     .op = OP_PRINT,   .results = 0, .name = "print" },
+  { .library = NULL,     .op = OP_INHERIT, .results = 1, .name = "inherit" },
+  { .library = NULL,     .op = OP_KEYS,    .results = 1, .name = "keys" },
+  { .library = NULL,     .op = OP_VALUES,  .results = 1, .name = "values" },
+  { .library = NULL,     .op = OP_COLLECT, .results = 1, .name = "collect" },
+  { .library = "io",     .op = OP_FLUSH,   .results = 0, .name = "flush" },
+  { .library = "io",     .op = OP_MMAP,    .results = 1, .name = "mmap" },
+  { .library = "io",     .op = OP_READ,    .results = 1, .name = "read" },
+  { .library = "io",     .op = OP_LINES,   .results = 1, .name = "lines" },
+  { .library = "io",     .op = OP_WRITE,   .results = 1, .name = "write" },
+  { .library = "io",     .op = OP_PIPE,    .results = 2, .name = "pipe" },
+  { .library = "io",     .op = OP_SOCKETPAIR, .results = 2, .name = "socketpair" },
+  { .library = "io",     .op = OP_SPAWN,   .results = 1, .name = "spawn" },
+  { .library = "io",     .op = OP_RUN,     .results = 0, .name = "run" },
+  { .library = "thread", .op = OP_THREAD,  .results = 1, .name = "spawn" },
+  { .library = "thread", .op = OP_JOIN,    .results = 1, .name = "join" },
+  { .library = "channel", .op = OP_CHANNEL, .results = 1, .name = "new" },
+  { .library = "channel", .op = OP_SEND,    .results = 1, .name = "send" },
+  { .library = "channel", .op = OP_TRY_SEND, .results = 1, .name = "try_send" },
+  { .library = "channel", .op = OP_RECV,    .results = 2, .name = "recv" },
+  { .library = "channel", .op = OP_TRY_RECV, .results = 2, .name = "try_recv" },
+  { .library = "channel", .op = OP_CLOSE,   .results = 0, .name = "close" },
+  { .library = "parallel", .op = OP_PARALLEL_MAP, .results = 1, .name = "map" },
+  { .library = "parallel", .op = OP_PARALLEL_REDUCE, .results = 1, .name = "reduce" },
 };
 
+int wrapper_count = sizeof(wrappers) / sizeof(struct wrapper);
+
+// C functions added by lt_register(). Every interpreter opened afterwards
+// compiles their stubs after the builtins', so interpreters opened by
+// thread.spawn() and parallel.map() agree on code offsets.
+static struct wrapper natives[FUNC_LIMIT - OP_CUSTOM];
+static int native_count;
+
 void
 wtf (const char *file, unsigned int line, const char *func)
 {
+  output_sync();
   fprintf(stderr, "wtf: %s %d %s\n", file, line, func);
   fflush(stderr);
   exit(EXIT_FAILURE);
@@ -274,22 +290,79 @@ ivec_empty (ivec_t *ivec)
 cor_t*
 routine ()
 {
-  return routines[routine_count-1];
+  return routine_top;
+}
+
+// The running coroutine is on top, above the chain of coroutines that
+// resumed it; the chain grows with nested pipelines.
+void
+routine_push (cor_t *cor)
+{
+  if (routine_count == routine_limit)
+  {
+    routine_limit *= 2;
+    routines = heap_realloc(routines, sizeof(cor_t*) * routine_limit);
+  }
+  routines[routine_count++] = cor;
+  routine_top = cor;
+}
+
+cor_t*
+routine_pop ()
+{
+  ensure(routine_count > 1)
+    errorf("yield outside a coroutine");
+
+  cor_t *cor = routines[--routine_count];
+  routine_top = routines[routine_count-1];
+  return cor;
+}
+
+int
+cor_pool_count ()
+{
+  return cor_pooled;
 }
 
 cor_t*
 cor_alloc ()
 {
+  cor_count++;
+  cor_created++;
   cor_t *cor = arena_alloc(cors, sizeof(cor_t));
-  memset(cor, 0, sizeof(cor_t));
 
-  cor->stack = vec_incref(vec_alloc());
-  cor->other = vec_incref(vec_alloc());
-  cor->selves = vec_incref(vec_alloc());
-  cor->scopes = vec_incref(vec_alloc());
-  ivec_init(&cor->calls);
-  ivec_init(&cor->loops);
-  ivec_init(&cor->marks);
+  ensure(cor)
+  {
+    stacktrace();
+    errorf("arena_alloc cors");
+  }
+
+  if (++collect_allocs == collect_threshold)
+    collect_pending = 1;
+
+  if (COLLECT_FULL(cors))
+    collect_urge();
+
+  if (cor_pooled)
+  {
+    *cor = cor_pool[--cor_pooled];
+  }
+  else
+  {
+    memset(cor, 0, sizeof(cor_t));
+    cor->stack = vec_incref(vec_alloc());
+    cor->other = vec_incref(vec_alloc());
+    cor->selves = vec_incref(vec_alloc());
+    cor->scopes = vec_incref(vec_alloc());
+    cor->stack->flags = VEC_ROOT;
+    cor->other->flags = VEC_ROOT;
+    cor->selves->flags = VEC_ROOT;
+    cor->scopes->flags = VEC_ROOT|VEC_SCOPES;
+    ivec_init(&cor->calls);
+    ivec_init(&cor->loops);
+    ivec_init(&cor->marks);
+  }
+
   cor->ref_count = 0;
   cor->flags = 0;
   cor->ip = 0;
@@ -302,6 +375,7 @@ cor_t*
 cor_incref (cor_t *cor)
 {
   cor->ref_count++;
+  cor->flags &= ~GC_COLOR;
   return cor;
 }
 
@@ -309,18 +383,146 @@ cor_t*
 cor_decref (cor_t *cor)
 {
   if (--cor->ref_count == 0)
+    collect_zero(cor, &cor->flags);
+  else
+  if ((cor->flags & GC_COLOR) != GC_PURPLE)
+    collect_root(cor, &cor->flags);
+  return cor;
+}
+
+// a root vec a collection is not looking at can go around again
+static int
+recyclable (vec_t *vec)
+{
+  return !(vec->flags & (GC_MASK & ~GC_COLOR));
+}
+
+// free a coroutine nothing refers to; its root vecs are its own
+void
+cor_free (cor_t *cor)
+{
+  if (cor_pooled < COR_POOL && recyclable(cor->stack) && recyclable(cor->other)
+    && recyclable(cor->selves) && recyclable(cor->scopes))
+  {
+    cor_t *pooled = &cor_pool[cor_pooled++];
+    pooled->stack = vec_clear(cor->stack);
+    pooled->other = vec_clear(cor->other);
+    pooled->selves = vec_clear(cor->selves);
+    pooled->scopes = vec_clear(cor->scopes);
+    pooled->calls = cor->calls;
+    pooled->loops = cor->loops;
+    pooled->marks = cor->marks;
+    pooled->calls.count = 0;
+    pooled->loops.count = 0;
+    pooled->marks.count = 0;
+  }
+  else
   {
-    vec_decref(cor->stack);
-    vec_decref(cor->other);
-    vec_decref(cor->selves);
-    vec_decref(cor->scopes);
+    vec_free(cor->stack);
+    vec_free(cor->other);
+    vec_free(cor->selves);
+    vec_free(cor->scopes);
     ivec_empty(&cor->calls);
     ivec_empty(&cor->loops);
     ivec_empty(&cor->marks);
-    memset(cor, 0, sizeof(cor_t));
-    cor = NULL;
   }
-  return cor;
+  unsigned int listed = cor->flags & (GC_BUFFERED|GC_ZCT);
+  memset(cor, 0, sizeof(cor_t));
+  cor_count--;
+  cor_destroyed++;
+  // a listed coroutine stays behind as a shell for its list to free
+  if (listed) cor->flags = listed|GC_SHELL;
+  else arena_free(cors, cor);
+}
+
+// give the pooled buffers back, so that --stats sees only live objects
+void
+cor_drain ()
+{
+  while (cor_pooled)
+  {
+    cor_t *cor = &cor_pool[--cor_pooled];
+    vec_free(cor->stack);
+    vec_free(cor->other);
+    vec_free(cor->selves);
+    vec_free(cor->scopes);
+    ivec_empty(&cor->calls);
+    ivec_empty(&cor->loops);
+    ivec_empty(&cor->marks);
+  }
+}
+
+void
+output_flush ()
+{
+  if (output_length)
+    fwrite(output_buffer, 1, output_length, stream_output);
+
+  output_length = 0;
+  fflush(stream_output);
+}
+
+// Diagnostics go straight to stderr, so whatever the script printed
+// before them goes out first. An ensure() may fail before lt_open().
+void
+output_sync ()
+{
+  if (lt && output_length)
+    output_flush();
+}
+
+void
+output_write (const char *str, int length)
+{
+  if (output_length + length > OUTPUT_BUFFER)
+    output_flush();
+
+  if (length > OUTPUT_BUFFER)
+  {
+    fwrite(str, 1, length, stream_output);
+    return;
+  }
+
+  memcpy(&output_buffer[output_length], str, length);
+  output_length += length;
+}
+
+// format directly into the output buffer, avoiding a strs allocation
+void
+output_value (void *ptr)
+{
+  if (is_text(ptr))
+  {
+    output_write(get_str(ptr), count(ptr));
+    return;
+  }
+
+  if (is_int(ptr) || is_dbl(ptr))
+  {
+    if (output_length + 32 > OUTPUT_BUFFER)
+      output_flush();
+
+    output_length += is_int(ptr)
+      ? snprintf(&output_buffer[output_length], 32, "%ld", get_int(ptr))
+      : snprintf(&output_buffer[output_length], 32, "%e", get_dbl(ptr));
+    return;
+  }
+
+  if (is_bool(ptr))
+  {
+    output_write(get_bool(ptr) ? "true": "false", get_bool(ptr) ? 4: 5);
+    return;
+  }
+
+  if (!ptr)
+  {
+    output_write("nil", 3);
+    return;
+  }
+
+  char *str = to_char(ptr);
+  output_write(str, strlen(str));
+  discard(str);
 }
 
 int is_bool (void *ptr) { return ptr == bool_true || ptr == bool_false; }
@@ -331,6 +533,23 @@ int is_vec (void *ptr) { return arena_within(vecs, ptr); }
 int is_map (void *ptr) { return arena_within(maps, ptr); }
 int is_cor (void *ptr) { return arena_within(cors, ptr); }
 int is_sub (void *ptr) { return arena_within(subs, ptr); }
+int is_slc (void *ptr) { return arena_within(slcs, ptr); }
+int is_io (void *ptr) { return arena_within(ios, ptr); }
+int is_chan (void *ptr) { return arena_within(chans, ptr); }
+int is_text (void *ptr) { return is_str(ptr) || is_slc(ptr); }
+
+// Stack and scope references to containers are not counted, see
+// collect_zero(). When one goes away the container is garbage if nothing
+// counted refers to it either, or else possibly the root of a cycle.
+static void
+forget (void *ptr, int refs, unsigned int *flags)
+{
+  if (!refs)
+    collect_zero(ptr, flags);
+  else
+  if ((*flags & GC_COLOR) != GC_PURPLE)
+    collect_root(ptr, flags);
+}
 
 int
 discard (void *ptr)
@@ -339,9 +558,12 @@ discard (void *ptr)
   if (is_int(ptr)) { int_count--; int_destroyed++; return arena_free(ints, ptr); }
   if (is_dbl(ptr)) { dbl_count--; dbl_destroyed++; return arena_free(dbls, ptr); }
   if (is_str(ptr)) { str_count--; str_destroyed++; return arena_free(strs, ptr); }
-  if (is_vec(ptr)) { vec_decref(ptr); return 1; }
-  if (is_map(ptr)) { map_decref(ptr); return 1; }
-  if (is_cor(ptr)) { cor_decref(ptr); return 1; }
+  if (is_vec(ptr)) { forget(ptr, ((vec_t*)ptr)->ref_count, &((vec_t*)ptr)->flags); return 1; }
+  if (is_map(ptr)) { forget(ptr, ((map_t*)ptr)->ref_count, &((map_t*)ptr)->flags); return 1; }
+  if (is_cor(ptr)) { forget(ptr, ((cor_t*)ptr)->ref_count, &((cor_t*)ptr)->flags); return 1; }
+  if (is_slc(ptr)) { slc_decref(ptr); return 1; }
+  if (is_io(ptr)) { io_decref(ptr); return 1; }
+  if (is_chan(ptr)) { chan_decref(ptr); return 1; }
   if (is_sub(ptr)) return 0;
   return 1;
 }
@@ -352,10 +574,31 @@ copy (void *ptr)
   if (is_int(ptr)) return to_int(get_int(ptr));
   if (is_dbl(ptr)) return to_dbl(get_dbl(ptr));
   if (is_str(ptr)) return substr(ptr, 0, strlen(ptr));
+  if (is_slc(ptr)) return slc_incref(ptr);
+  if (is_io(ptr)) return io_incref(ptr);
+  if (is_chan(ptr)) return chan_incref(ptr);
+  if (is_sub(ptr)) return ptr;
+  return ptr;
+}
+
+// a value moving from the stack or a scope into a table, array or other
+// counted place
+void*
+store (void *ptr)
+{
   if (is_vec(ptr)) return vec_incref(ptr);
   if (is_map(ptr)) return map_incref(ptr);
   if (is_cor(ptr)) return cor_incref(ptr);
-  if (is_sub(ptr)) return ptr;
+  return ptr;
+}
+
+// and back again
+void*
+unstore (void *ptr)
+{
+  if (is_vec(ptr)) vec_decref(ptr);
+  if (is_map(ptr)) map_decref(ptr);
+  if (is_cor(ptr)) cor_decref(ptr);
   return ptr;
 }
 
@@ -366,7 +609,9 @@ equal (void *a, void *b)
   if (is_int(a) && is_int(b)) return get_int(a) == get_int(b);
   if (is_dbl(a) && is_dbl(b)) return fabs(get_dbl(a) - get_dbl(b)) <= DBL_MIN;
   if (is_str(a) && is_str(b)) return !strcmp(a, b);
+  if (is_text(a) && is_text(b)) return count(a) == count(b) && !memcmp(get_str(a), get_str(b), count(a));
   if (is_sub(a) && is_sub(b)) return get_sub(a) == get_sub(b);
+  if (is_chan(a) && is_chan(b)) return ((chan_t*)a)->channel == ((chan_t*)b)->channel;
 
   char *as = to_char(a);
   char *bs = to_char(b);
@@ -382,6 +627,21 @@ less (void *a, void *b)
   if (is_int(a) && is_int(b)) return get_int(a) < get_int(b);
   if (is_dbl(a) && is_dbl(b)) return get_dbl(a) < get_dbl(b);
   if (is_str(a) && is_str(b)) return strcmp(a, b) < 0;
+
+  if (is_text(a) && is_text(b))
+  {
+    int64_t al = count(a), bl = count(b);
+    int rc = memcmp(get_str(a), get_str(b), al < bl ? al: bl);
+    return rc < 0 || (rc == 0 && al < bl);
+  }
+  return 0;
+}
+
+int
+equal_str (void *a, const char *b)
+{
+  if (is_str(a)) return !strcmp(a, b);
+  if (is_slc(a)) return count(a) == strlen(b) && !memcmp(get_str(a), b, count(a));
   return 0;
 }
 
@@ -389,6 +649,7 @@ int64_t
 count (void *a)
 {
   if (is_str(a)) return strlen(a);
+  if (is_slc(a)) return ((slc_t*)a)->length;
   if (is_vec(a)) return ((vec_t*)a)->count;
   if (is_map(a)) return ((map_t*)a)->count;
   return 0;
@@ -401,6 +662,8 @@ truth (void *a)
   if (is_int(a) && get_int(a) != 0) return 1;
   if (is_dbl(a) && fabs(get_dbl(a) > DBL_MIN)) return 1;
   if (is_sub(a)) return 1;
+  if (is_io(a)) return 1;
+  if (is_chan(a)) return 1;
   return count(a) != 0;
 }
 
@@ -408,6 +671,7 @@ uint32_t
 hash (void *item)
 {
   if (is_str(item)) return str_djb_hash(item);
+  if (is_slc(item)) return str_djb_hash_len(get_str(item), count(item));
   return 0;
 }
 
@@ -428,6 +692,10 @@ to_int (int64_t n)
 {
   int64_t *ptr = arena_alloc(ints, sizeof(int64_t));
   ensure(ptr) errorf("ints_mem exceeded");
+
+  if (COLLECT_FULL(ints))
+    collect_urge();
+
   int_count++;
   int_created++;
   *ptr = n;
@@ -445,6 +713,10 @@ to_dbl (double n)
 {
   double *ptr = arena_alloc(dbls, sizeof(double));
   ensure(ptr) errorf("dbls_mem exceeded");
+
+  if (COLLECT_FULL(dbls))
+    collect_urge();
+
   dbl_count++;
   dbl_created++;
   *ptr = n;
@@ -467,11 +739,21 @@ to_char (void *ptr)
   if (is_vec(ptr)) return vec_char(ptr);
   if (is_map(ptr)) return map_char(ptr);
   if (is_cor(ptr)) return strf("cor()");
+  if (is_slc(ptr)) return slc_str(ptr);
+  if (is_io(ptr)) return strf("io(%d)", ((io_t*)ptr)->fd);
+  if (is_chan(ptr)) return strf("channel()");
   if (is_sub(ptr)) return strf("sub[%ld]", get_sub(ptr));
   if (!ptr) return strf("nil");
   return strf("ptr: %llu", (uint64_t)ptr);
 }
 
+char*
+get_str (void *ptr)
+{
+  if (is_slc(ptr)) return ((slc_t*)ptr)->str + ((slc_t*)ptr)->offset;
+  return is_str(ptr) ? ptr: NULL;
+}
+
 int64_t*
 to_sub (int64_t n)
 {
@@ -638,6 +920,18 @@ compile (int op)
     return a;
   }
 
+  if (a && op == OP_SET && a->op == OP_LIT)
+  {
+    a->op = OP_SET_LIT;
+    return a;
+  }
+
+  if (a && op == OP_ASSIGN && a->op == OP_LIT)
+  {
+    a->op = OP_ASSIGN_LIT;
+    return a;
+  }
+
   if (a && op == OP_CALL && a->op == OP_FIND_LIT)
   {
     a->op = OP_CALL_LIT;
@@ -680,22 +974,224 @@ compile (int op)
   return c;
 }
 
+// stack operands an opcode only reads before dropping
+static int
+borrows (int op)
+{
+  switch (op)
+  {
+    case OP_GET_LIT:
+    case OP_LT_LIT:
+    case OP_COUNT:
+    case OP_NOT:
+      return 1;
+
+    case OP_GET:
+    case OP_EQ:
+    case OP_NE:
+    case OP_LT:
+    case OP_GT:
+    case OP_LTE:
+    case OP_GTE:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_MOD:
+    case OP_CONCAT:
+      return 2;
+  }
+  return 0;
+}
+
+// Let literals and variable reads feeding straight into a consumer push
+// their value without a copy, and tell the consumer not to discard it.
+// Nothing runs in between that could free the value or reach a statement
+// boundary. A jump landing between producer and consumer could bring an
+// owned value instead, so those pairs are left alone.
+void
+code_borrow (int base)
+{
+  char *target = calloc(code_count + 1, 1);
+  ensure(target) errorf("%s calloc", __func__);
+
+  for (int i = base; i < code_count; i++)
+  {
+    code_t *c = &code[i];
+
+    switch (c->op)
+    {
+      case OP_JMP:
+      case OP_JFALSE:
+      case OP_JTRUE:
+      case OP_AND:
+      case OP_OR:
+      case OP_LOOP:
+      case OP_FOR:
+        if (c->offset >= 0 && c->offset <= code_count) target[c->offset] = 1;
+        break;
+
+      case OP_LIT:
+        if (is_sub(c->ptr) && get_sub(c->ptr) <= code_count) target[get_sub(c->ptr)] = 1;
+        break;
+    }
+  }
+
+  for (int i = base; i < code_count; i++)
+  {
+    code_t *c = &code[i];
+
+    // producers' offsets are otherwise unused
+    if (c->op == OP_LIT || c->op == OP_FIND_LIT)
+    {
+      c->offset = 0;
+      continue;
+    }
+
+    int operands = borrows(c->op);
+
+    if (!operands)
+      continue;
+
+    c->offset = 0;
+
+    code_t *top = i-1 >= base ? &code[i-1]: NULL;
+    code_t *under = i-2 >= base ? &code[i-2]: NULL;
+
+    if (!top || target[i] || (top->op != OP_LIT && top->op != OP_FIND_LIT))
+      continue;
+
+    top->offset = BORROW_PUSH;
+    c->offset |= BORROW_TOP;
+
+    if (operands < 2 || !under || target[i-1] || (under->op != OP_LIT && under->op != OP_FIND_LIT))
+      continue;
+
+    under->offset = BORROW_PUSH;
+    c->offset |= BORROW_UNDER;
+  }
+
+  free(target);
+}
+
+// "line:column" of the source that compiled an instruction, or ""
+static char*
+code_line (code_t *c)
+{
+  int line, column;
+  return line_find(c - code, &line, &column) ? strf("%d:%d", line, column): strf("");
+}
+
 void
 decompile (code_t *c)
 {
   char *str = to_char(c->ptr);
-  fprintf(stderr, "%04ld  %04d  %-10s %4d   %s\n", c - code, routine()->flags, funcs[c->op].name, c->offset, str);
+  char *pos = code_line(c);
+  fprintf(stderr, "%04ld  %-8s %04d  %-10s %4d   %s\n", c - code, pos, routine()->flags & ~GC_MASK, funcs[c->op].name, c->offset, str);
   fflush(stderr);
+  discard(pos);
   discard(str);
 }
 
+int
+is_jump (int op)
+{
+  return op == OP_JMP || op == OP_JFALSE || op == OP_JTRUE || op == OP_AND
+    || op == OP_OR || op == OP_LOOP || op == OP_FOR;
+}
+
+// full listing to the buffered output stream; jump and function targets
+// are marked with '>'
+void
+disassemble ()
+{
+  char *targets = heap_alloc(code_count+1);
+  memset(targets, 0, code_count+1);
+
+  for (code_t *c = &code[0]; c->op; c++)
+  {
+    if (is_jump(c->op) && c->offset >= 0 && c->offset <= code_count)
+      targets[c->offset] = 1;
+
+    if (is_sub(c->ptr) && get_sub(c->ptr) >= 0 && get_sub(c->ptr) <= code_count)
+      targets[get_sub(c->ptr)] = 1;
+  }
+
+  for (code_t *c = &code[0]; c->op; c++)
+  {
+    char *lit = NULL;
+
+    if (is_text(c->ptr))
+    {
+      char *tmp = to_char(c->ptr);
+      lit = str_quote(tmp);
+      discard(tmp);
+    }
+    else
+    if (c->ptr || c->op == OP_LIT)
+    {
+      lit = to_char(c->ptr);
+    }
+
+    char *pos = code_line(c);
+    char *line = strf("%c%04ld  %-8s %-10s %4d   %s\n", targets[c - code] ? '>': ' ',
+      c - code, pos, funcs[c->op].name, c->offset, lit ? lit: "");
+
+    output_write(line, strlen(line));
+    discard(line);
+    discard(pos);
+    discard(lit);
+  }
+
+  output_flush();
+  heap_free(targets);
+}
+
 void stacktrace ()
 {
+  output_sync();
   decompile(&code[routine()->ip-1]);
-  for (int i = routine()->calls.count-1; i >= 0; i--)
+
+  // calls holds (loops, marks, return ip) triples
+  for (int i = routine()->calls.count-1; i >= 2; i -= 3)
     decompile(&code[ivec_cell(&routine()->calls, i)[0]-1]);
 }
 
+// Call a function from C, with the top args items of the stack as its
+// arguments. It runs on a coroutine of its own until it returns or
+// yields, and what it passes back replaces the arguments. Returns the
+// number of results.
+int
+call (int64_t ip, int args)
+{
+  cor_t *home = routine();
+  int mark = ivec_cell(&home->marks, -1)[0];
+  int base = home->stack->count - args;
+
+  cor_t *cor = cor_alloc();
+  cor->ip = ip;
+  vec_push(cor->scopes)[0] = map_scope();
+
+  for (int i = 0; i < args; i++)
+    vec_push(cor->stack)[0] = vec_get(home->stack, base + i)[0];
+
+  home->stack->count = base;
+  cor->state = COR_RUNNING;
+
+  int level = routine_count;
+  routine_push(cor);
+
+  while (routine_count > level)
+  {
+    int op = code[routine()->ip++].op;
+    if (op != OP_NOP) funcs[op].func();
+  }
+
+  // op_yield counted the results into the mark, as for a resume
+  ivec_cell(&home->marks, -1)[0] = mark;
+  return home->stack->count - base;
+}
+
 void
 run ()
 {
@@ -715,64 +1211,51 @@ run ()
   }
 }
 
-void
-slurp ()
+// a library map in scope_core, or scope_core itself
+static map_t*
+library (const char *name)
 {
-  char *path = pop();
-  push(NULL);
+  if (!name)
+    return scope_core;
 
-  struct stat st;
-  if (stat(path, &st) == 0)
-  {
-    FILE *file = fopen(path, "r");
+  char *key = substr((char*)name, 0, strlen(name));
+  void **slot = map_get(scope_core, key);
+  discard(key);
 
-    if (file)
-    {
-      size_t bytes = st.st_size;
-      void *ptr = arena_alloc(strs, bytes + 1);
-
-      size_t read = 0;
-      for (int i = 0; i < 3; i++)
-      {
-        read += fread(ptr + read, 1, bytes - read, file);
-        if (read == bytes) break;
-      }
-      ((char*)ptr)[bytes] = 0;
-
-      if (read == bytes)
-      {
-        op_drop();
-        push(ptr);
-      }
-      else
-      {
-        arena_free(strs, ptr);
-      }
-    }
-    fclose(file);
-  }
-  discard(path);
+  if (slot)
+    return slot[0];
+
+  map_t *map = map_alloc();
+  map_set_str(scope_core, (char*)name)[0] = map_incref(map);
+  return map;
 }
 
-int
-main (int argc, char const *argv[])
+// a function that runs one op and returns
+static void
+stub (struct wrapper *wrapper)
 {
-  char *script = NULL;
-  heap_mem = 8*MB;
+  char *name = substr(wrapper->name, 0, strlen(wrapper->name));
+  map_set(library(wrapper->library), name)[0] = to_sub(code_count);
+  compile(wrapper->op);
+  compile(OP_RETURN);
+  discard(name);
+}
 
-  for (int argi = 0; argi < argc; argi++)
-  {
-    if ((!strcmp(argv[argi], "-m") || !strcmp(argv[argi], "--memory")) && argi+1 < argc)
-    {
-      heap_mem = strtoll(argv[++argi], NULL, 0) * MB;
-      continue;
-    }
+// Start an interpreter in a heap of the given size and make it the
+// calling thread's current one. Nothing is loaded yet: the main routine
+// waits at the end of the builtin stubs for the first source().
+lt_state*
+lt_open (int memory, int flags)
+{
+  lt = calloc(1, sizeof(lt_state));
+  ensure(lt) errorf("%s calloc", __func__);
 
-    script = (char*)argv[argi];
-  }
+  lt_flags = flags;
+  sched_epoll = -1;
+  ring_fd = -1;
+  ring_enabled = !(flags & LT_NO_URING);
 
-  ensure(script)
-    errorf("expected script");
+  heap_mem = memory;
 
   if (heap_mem < 1*MB)
   {
@@ -787,6 +1270,9 @@ main (int argc, char const *argv[])
   maps_mem = heap_mem * 0.01;
   cors_mem = heap_mem * 0.01;
   subs_mem = heap_mem * 0.01;
+  slcs_mem = heap_mem * 0.01;
+  ios_mem = heap_mem * 0.01;
+  chans_mem = heap_mem * 0.01;
 
   heap = malloc(heap_mem);
   ensure(heap) errorf("malloc heap %u", heap_mem);
@@ -813,9 +1299,16 @@ main (int argc, char const *argv[])
   subs = heap_alloc(subs_mem);
   arena_open(subs, subs_mem, sizeof(int64_t));
 
-  int _bt = 1, _bf = 0;
-  bool_true  = &_bt;
-  bool_false = &_bf;
+  slcs = heap_alloc(slcs_mem);
+  arena_open(slcs, slcs_mem, sizeof(slc_t));
+
+  ios = heap_alloc(ios_mem);
+  arena_open(ios, ios_mem, sizeof(io_t));
+
+  chans = heap_alloc(chans_mem);
+  arena_open(chans, chans_mem, sizeof(chan_t));
+
+  collect_init();
 
   code_count = 0;
   code_limit = 1024;
@@ -823,51 +1316,309 @@ main (int argc, char const *argv[])
   memset(code, 0, sizeof(code_t) * code_limit);
 
   stream_output = stdout;
+  output_tty = isatty(fileno(stream_output));
+  stream_input = io_incref(io_alloc(STDIN_FILENO));
 
   scope_core = map_incref(map_alloc());
-  scope_global = map_incref(map_alloc());
+  scope_global = map_incref(map_scope());
   super_str = map_incref(map_alloc());
   super_vec = map_incref(map_alloc());
   super_map = map_incref(map_alloc());
 
   routine_count = 0;
-  routines = heap_alloc(sizeof(cor_t*) * 32);
+  routine_limit = 32;
+  routines = heap_alloc(sizeof(cor_t*) * routine_limit);
 
-  routines[routine_count++] = cor_incref(cor_alloc());
+  routine_push(cor_incref(cor_alloc()));
 
   op_mark();
-  //op_scope();
 
-  for (int i = 0; i < sizeof(wrappers) / sizeof(struct wrapper); i++)
+  for (int i = 0; i < wrapper_count; i++)
+    stub(&wrappers[i]);
+
+  for (int i = 0; i < native_count; i++)
+    stub(&natives[i]);
+
+  routine()->ip = code_count;
+
+  return lt;
+}
+
+// Stop an interpreter and release everything it holds. The heap goes in
+// one piece; only what lives outside it needs a walk.
+void
+lt_close (lt_state *state)
+{
+  lt = state;
+
+  parallel_close();
+  output_flush();
+  cor_drain();
+  collect_close();
+  sched_shutdown();
+  ring_close();
+
+  for (cor_t *cor = arena_next(cors, NULL); cor; cor = arena_next(cors, cor))
   {
-    char *name = substr(wrappers[i].name, 0, strlen(wrappers[i].name));
-    map_set(wrappers[i].library[0], name)[0] = to_sub(code_count);
-    compile(wrappers[i].op);
-    compile(OP_RETURN);
-    discard(name);
+    ivec_empty(&cor->calls);
+    ivec_empty(&cor->loops);
+    ivec_empty(&cor->marks);
   }
 
-  routine()->ip = code_count;
+  slc_unmap_all();
+  io_close_all();
+  chan_free_all();
 
-  push(strf("%s", argv[1]));
-  slurp();
+  free(script_chunks);
+  free(line_table);
+  free(line_points);
+  free(heap);
+  free(lt);
 
-  ensure(top())
-    errorf("failed to read %s", script);
+  lt = NULL;
+}
 
-  source(top());
-  op_drop();
+// the op of every lt_register() function: the results it pushed replace
+// its arguments
+static void
+op_native ()
+{
+  int op = code[routine()->ip-1].op;
+  int args = depth();
 
-  for (code_t *c = &code[0]; c->op; c++)
-    decompile(c);
+  funcs[op].native(lt);
+
+  vec_t *values = stack();
+  int base = values->count - depth();
+
+  for (int i = 0; i < args; i++)
+    discard(vec_del(values, base));
+}
+
+// Make a C function callable from scripts as library.name, or as a core
+// function when library is NULL. Functions must be registered before the
+// interpreters that use them are opened. Returns the function's op.
+int
+lt_register (const char *library, const char *name, lt_native native)
+{
+  ensure(func_count < FUNC_LIMIT)
+    errorf("%s: more than %d functions", __func__, FUNC_LIMIT - OP_CUSTOM);
+
+  char *lib = library ? strdup(library): NULL;
+  char *fn = strdup(name);
+  ensure(fn && (lib || !library)) errorf("%s strdup", __func__);
+
+  int op = func_count++;
+  funcs[op] = (func_t){ .name = fn, .func = op_native, .native = native };
+  natives[native_count++] = (struct wrapper){ .library = lib, .op = op, .name = fn };
+
+  return op;
+}
+
+// Keep a reference to each chunk of compiled source, in order, for
+// thread.spawn(function) and parallel.map() to compile the same code.
+void
+script_keep (slc_t *text)
+{
+  if (script_chunk_count == script_chunk_limit)
+  {
+    script_chunk_limit = script_chunk_limit ? script_chunk_limit * 2: 4;
+    script_chunks = realloc(script_chunks, sizeof(slc_t*) * script_chunk_limit);
+    ensure(script_chunks) errorf("%s realloc", __func__);
+  }
+  script_chunks[script_chunk_count++] = text;
+}
 
+// compile and run the top level of more source
+static void
+load (slc_t *text)
+{
+  script_keep(slc_incref(text));
+  source(slc_incref(text));
   run();
+  output_flush();
+}
+
+void
+lt_load_string (lt_state *state, const char *text, int length)
+{
+  lt = state;
+  load(slc_alloc(substr((char*)text, 0, length)));
+}
+
+// Returns -1 when the file cannot be read.
+int
+lt_load_file (lt_state *state, const char *path)
+{
+  lt = state;
 
-  errorf("COUNT    ints: %3d,  dbls: %3d,  strs: %3d,  vecs: %3d,  maps: %3d  cors: %3d  subs: %3d", int_count, dbl_count, str_count, vec_count, map_count, cor_count, sub_count);
-  errorf("CREATE   ints: %3d,  dbls: %3d,  strs: %3d,  vecs: %3d,  maps: %3d  cors: %3d  subs: %3d", int_created, dbl_created, str_created, vec_created, map_created, cor_created, sub_created);
-  errorf("DESTROY  ints: %3d,  dbls: %3d,  strs: %3d,  vecs: %3d,  maps: %3d  cors: %3d  subs: %3d", int_destroyed, dbl_destroyed, str_destroyed, vec_destroyed, map_destroyed, cor_destroyed, sub_destroyed);
-  errorf("               %3d,        %3d,        %3d,        %3d,        %3d        %3d        %3d", int_count-(int_created-int_destroyed), dbl_count-(dbl_created-dbl_destroyed), str_count-(str_created-str_destroyed), vec_count-(vec_created-vec_destroyed), map_count-(map_created-map_destroyed), cor_count-(cor_created-cor_destroyed), sub_count-(sub_created-sub_destroyed));
+  slc_t *text = slc_mmap((char*)path);
+  if (!text) return -1;
 
+  load(text);
   return 0;
 }
 
+// a global or core function, or a dotted path through tables to one
+static void*
+lookup (const char *name)
+{
+  map_t *scope = NULL;
+
+  for (;;)
+  {
+    const char *dot = strchr(name, '.');
+    int length = dot ? dot - name: strlen(name);
+
+    char *key = substr((char*)name, 0, length);
+    void **slot = scope ? map_get(scope, key): map_get(scope_global, key);
+    if (!slot && !scope) slot = map_get(scope_core, key);
+    discard(key);
+
+    void *val = slot ? slot[0]: NULL;
+
+    if (!dot) return val;
+    if (!is_map(val)) return NULL;
+
+    scope = val;
+    name = dot + 1;
+  }
+}
+
+// Call a function with the top args values of the stack as its arguments.
+// Its results replace them. Returns the number of results, or -1 when
+// there is no such function, having dropped the arguments.
+int
+lt_call (lt_state *state, const char *name, int args)
+{
+  lt = state;
+
+  ensure(args >= 0 && args <= depth())
+    errorf("%s: %d arguments but %d values on the stack", __func__, args, depth());
+
+  void *func = lookup(name);
+
+  if (!is_sub(func))
+  {
+    while (args-- > 0) op_drop();
+    return -1;
+  }
+
+  int results = call(get_sub(func), args);
+  output_flush();
+  return results;
+}
+
+int
+lt_depth (lt_state *state)
+{
+  lt = state;
+  return depth();
+}
+
+void
+lt_pop (lt_state *state, int count)
+{
+  lt = state;
+  while (count-- > 0 && depth()) op_drop();
+}
+
+void
+lt_push_nil (lt_state *state)
+{
+  lt = state;
+  push(NULL);
+}
+
+void
+lt_push_bool (lt_state *state, int flag)
+{
+  lt = state;
+  push_bool(flag);
+}
+
+void
+lt_push_int (lt_state *state, int64_t n)
+{
+  lt = state;
+  push_int(n);
+}
+
+void
+lt_push_dbl (lt_state *state, double d)
+{
+  lt = state;
+  push_dbl(d);
+}
+
+void
+lt_push_str (lt_state *state, const char *str, int length)
+{
+  lt = state;
+  push(substr((char*)str, 0, length));
+}
+
+static void*
+value_at (int index)
+{
+  if (index < 0) index += depth();
+
+  ensure(index >= 0 && index < depth())
+    errorf("no value at stack index %d", index);
+
+  return item(index)[0];
+}
+
+int
+lt_type (lt_state *state, int index)
+{
+  lt = state;
+  void *value = value_at(index);
+
+  return !value ? LT_NIL
+    : is_bool(value) ? LT_BOOL
+    : is_int(value) ? LT_INT
+    : is_dbl(value) ? LT_DBL
+    : is_text(value) ? LT_STR
+    : is_vec(value) ? LT_ARRAY
+    : is_map(value) ? LT_TABLE
+    : is_sub(value) ? LT_FUNCTION
+    : LT_OTHER;
+}
+
+int
+lt_to_bool (lt_state *state, int index)
+{
+  lt = state;
+  return truth(value_at(index));
+}
+
+// numbers convert between int and double; anything else is 0
+int64_t
+lt_to_int (lt_state *state, int index)
+{
+  lt = state;
+  void *value = value_at(index);
+  return is_int(value) ? get_int(value): is_dbl(value) ? (int64_t)get_dbl(value): 0;
+}
+
+double
+lt_to_dbl (lt_state *state, int index)
+{
+  lt = state;
+  void *value = value_at(index);
+  return is_dbl(value) ? get_dbl(value): is_int(value) ? (double)get_int(value): 0;
+}
+
+// A string's bytes, which need not end in a NUL, or NULL for other
+// values. Valid until the value is popped.
+const char*
+lt_to_str (lt_state *state, int index, int *length)
+{
+  lt = state;
+  void *value = value_at(index);
+
+  if (!is_text(value)) return NULL;
+  if (length) *length = count(value);
+  return get_str(value);
+}
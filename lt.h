@@ -21,30 +21,98 @@ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
 SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 */
 
+// Embedding API. A program linked with liblt.a includes lt.h with
+// LT_EMBED defined, which leaves out everything after this part.
+//
+// Each interpreter has a stack of values. Indexes count from 0 at the
+// bottom, or from -1 at the top. Functions take the interpreter to work
+// on, so a thread may use several, one call at a time; an interpreter
+// must not be used by two threads at once. Script errors print a stack
+// trace and end the process, as they do for the lt binary.
+
+#include <stdint.h>
+
+typedef struct lt_state lt_state;
+
+// A C function callable from scripts. Its arguments are the values on the
+// stack when it is called, and whatever it pushes are its results.
+typedef void (*lt_native) (lt_state*);
+
+// lt_open() flags
+#define LT_NO_URING (1<<1)
+
+// lt_type() results
+enum {
+  LT_NIL = 0,
+  LT_BOOL,
+  LT_INT,
+  LT_DBL,
+  LT_STR,
+  LT_ARRAY,
+  LT_TABLE,
+  LT_FUNCTION,
+  LT_OTHER,
+};
+
+lt_state* lt_open (int memory, int flags);
+void lt_close (lt_state*);
+int lt_register (const char *library, const char *name, lt_native);
+void lt_load_string (lt_state*, const char *text, int length);
+// 0, or -1 when the file cannot be read
+int lt_load_file (lt_state*, const char *path);
+int lt_call (lt_state*, const char *name, int args);
+int lt_depth (lt_state*);
+void lt_pop (lt_state*, int count);
+void lt_push_nil (lt_state*);
+void lt_push_bool (lt_state*, int);
+void lt_push_int (lt_state*, int64_t);
+void lt_push_dbl (lt_state*, double);
+void lt_push_str (lt_state*, const char*, int length);
+int lt_type (lt_state*, int index);
+int lt_to_bool (lt_state*, int index);
+int64_t lt_to_int (lt_state*, int index);
+double lt_to_dbl (lt_state*, int index);
+const char* lt_to_str (lt_state*, int index, int *length);
+
+#ifndef LT_EMBED
+
 void wtf (const char *file, unsigned int line, const char *func);
 
 #define ensure(x) for ( ; !(x) ; wtf(__FILE__, __LINE__, __func__) )
-#define errorf(...) do { fprintf(stderr, __VA_ARGS__); fputc('\n', stderr); fflush(stderr); } while(0)
+#define errorf(...) do { output_sync(); fprintf(stderr, __VA_ARGS__); fputc('\n', stderr); fflush(stderr); } while(0)
 
-void *bool_true;
-void *bool_false;
+extern void *bool_true;
+extern void *bool_false;
 
 #define FLAG_TRUE (1<<0)
 
 #define KB (1024)
 #define MB (KB*KB)
 
+#define OUTPUT_BUFFER (64*KB)
+
 typedef struct {
   int op;
   int offset;
   void *ptr;
 } code_t;
 
+// offset flags set by code_borrow(): a literal or variable read that
+// pushes its value without a copy, and which operands of the consumer
+// right after it arrive that way
+#define BORROW_PUSH (1<<0)
+#define BORROW_TOP (1<<0)
+#define BORROW_UNDER (1<<1)
+
 typedef void (*opcb)();
 
+// op numbers from OP_CUSTOM up are C functions added by lt_register()
+#define FUNC_LIMIT 1024
+
 typedef struct {
   const char *name;
   opcb func;
+  lt_native native;
 } func_t;
 
 typedef struct {
@@ -62,8 +130,9 @@ typedef struct {
   ivec_t loops;
   ivec_t marks;
   int ip;
-  int flags;
+  unsigned int flags;
   int ref_count;
+  int crc;
   int state;
 } cor_t;
 
@@ -71,8 +140,12 @@ typedef struct {
 #define COR_RUNNING 1
 #define COR_DEAD 2
 
+// Dead coroutines leave their root vecs and ivec buffers in a pool, so
+// that creating a coroutine is one arena allocation while the pool lasts.
+#define COR_POOL 256
+
 struct wrapper {
-  map_t **library;
+  const char *library;
   int op;
   int arguments;
   int results;
@@ -95,6 +168,13 @@ int is_vec (void*);
 int is_map (void*);
 int is_cor (void*);
 int is_sub (void*);
+int is_slc (void*);
+int is_io (void*);
+int is_chan (void*);
+int is_text (void*);
+int is_jump (int);
+char* get_str (void*);
+int equal_str (void*, const char*);
 char* to_char (void*);
 void* to_bool(int);
 int get_bool(void*);
@@ -107,6 +187,8 @@ double get_dbl(void*);
 int discard (void*);
 int equal (void*,void*);
 void* copy (void*);
+void* store (void*);
+void* unstore (void*);
 int64_t count (void*);
 int truth (void*);
 int less (void*,void*);
@@ -129,61 +211,31 @@ void** item (int);
 void* self ();
 int depth ();
 void stacktrace ();
+void run ();
+void script_keep (slc_t*);
+int call (int64_t, int);
 code_t* compile (int);
+void code_borrow (int);
 code_t* hindsight (int);
 cor_t* routine ();
+void routine_push (cor_t*);
+cor_t* routine_pop ();
 void decompile (code_t*);
+void disassemble ();
 cor_t* cor_alloc ();
 cor_t* cor_incref ();
 cor_t* cor_decref ();
-
-extern arena_t *heap;
-extern arena_t *ints;
-extern arena_t *dbls;
-extern arena_t *strs;
-extern arena_t *vecs;
-extern arena_t *maps;
-extern arena_t *cors;
-
-extern int int_count;
-extern int int_created;
-extern int int_destroyed;
-extern int dbl_count;
-extern int dbl_created;
-extern int dbl_destroyed;
-extern int str_count;
-extern int str_created;
-extern int str_destroyed;
-extern int vec_count;
-extern int vec_created;
-extern int vec_destroyed;
-extern int map_count;
-extern int map_created;
-extern int map_destroyed;
-extern int cor_count;
-extern int cor_created;
-extern int cor_destroyed;
-
-extern int heap_mem;
-extern int ints_mem;
-extern int dbls_mem;
-extern int strs_mem;
-extern int vecs_mem;
-extern int maps_mem;
-extern int cors_mem;
-
-extern map_t *scope_core;
-extern map_t *scope_global;
-extern map_t *super_str;
-extern map_t *super_vec;
-extern map_t *super_map;
-extern map_t *super_cor;
-
-extern cor_t **routines;
-extern int routine_count;
-extern int routine_limit;
-
-extern code_t *code;
-extern int code_count;
-extern int code_limit;
-extern FILE *stream_output;
+void cor_free (cor_t*);
+void cor_drain ();
+int cor_pool_count ();
+void output_write (const char*, int);
+void output_value (void*);
+void output_flush ();
+void output_sync ();
+
+extern func_t funcs[];
+extern int func_count;
+extern struct wrapper wrappers[];
+extern int wrapper_count;
+
+#endif
@@ -0,0 +1,185 @@
+/*
+Copyright (c) 2016 Sean Pringle sean.pringle@gmail.com
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <pthread.h>
+
+#include "arena.h"
+#include "op.h"
+#include "str.h"
+#include "vec.h"
+#include "map.h"
+#include "parse.h"
+#include "lt.h"
+#include "collect.h"
+#include "io.h"
+#include "ring.h"
+#include "cache.h"
+#include "profile.h"
+#include "sched.h"
+#include "line.h"
+#include "thread.h"
+#include "parallel.h"
+#include "state.h"
+
+int
+main (int argc, char const *argv[])
+{
+  char *script = NULL;
+  int use_cache = 0;
+  int use_disassemble = 0;
+  int use_stats = 0;
+  int use_profile = 0;
+  int flags = 0;
+  int memory = 8*MB;
+  int workers = 0;
+
+  for (int argi = 0; argi < argc; argi++)
+  {
+    if ((!strcmp(argv[argi], "-m") || !strcmp(argv[argi], "--memory")) && argi+1 < argc)
+    {
+      memory = strtoll(argv[++argi], NULL, 0) * MB;
+      continue;
+    }
+
+    if ((!strcmp(argv[argi], "-w") || !strcmp(argv[argi], "--workers")) && argi+1 < argc)
+    {
+      workers = strtol(argv[++argi], NULL, 0);
+      continue;
+    }
+
+    if (!strcmp(argv[argi], "-c") || !strcmp(argv[argi], "--cache"))
+    {
+      use_cache = 1;
+      continue;
+    }
+
+    if (!strcmp(argv[argi], "-d") || !strcmp(argv[argi], "--disassemble"))
+    {
+      use_disassemble = 1;
+      continue;
+    }
+
+    if (!strcmp(argv[argi], "-s") || !strcmp(argv[argi], "--stats"))
+    {
+      use_stats = 1;
+      continue;
+    }
+
+    if (!strcmp(argv[argi], "--profile-ops"))
+    {
+      use_profile |= PROFILE_OPS;
+      continue;
+    }
+
+    if (!strcmp(argv[argi], "--profile"))
+    {
+      use_profile |= PROFILE_SAMPLE;
+      continue;
+    }
+
+    if (!strcmp(argv[argi], "--alloc-profile"))
+    {
+      use_profile |= PROFILE_ALLOC;
+      continue;
+    }
+
+    if (!strcmp(argv[argi], "--no-uring"))
+    {
+      flags |= LT_NO_URING;
+      continue;
+    }
+
+    script = (char*)argv[argi];
+  }
+
+  ensure(script)
+    errorf("expected script");
+
+  lt_open(memory, flags);
+  parallel_workers = workers;
+
+  slc_t *text = slc_mmap(script);
+
+  ensure(text)
+    errorf("failed to read %s", script);
+
+  slc_incref(text);
+
+  // bytecode cache lives next to the script
+  char *cache = use_cache ? strf("%sc", script): NULL;
+
+  if (!cache || !cache_load(cache, text))
+  {
+    int base = code_count;
+    source(slc_incref(text));
+
+    if (cache)
+      cache_save(cache, text, base);
+  }
+
+  discard(cache);
+
+  // kept for thread.spawn(function)
+  script_keep(text);
+
+  if (use_disassemble)
+  {
+    disassemble();
+    return 0;
+  }
+
+  if (use_profile)
+    profile_run(use_profile);
+  else
+    run();
+
+  output_flush();
+  thread_join_all();
+  parallel_close();
+  profile_report();
+  cor_drain();
+
+  if (use_stats)
+  {
+    errorf("COUNT    ints: %3d,  dbls: %3d,  strs: %3d,  vecs: %3d,  maps: %3d  cors: %3d  subs: %3d  slcs: %3d", int_count, dbl_count, str_count, vec_count, map_count, cor_count, sub_count, slc_count);
+    errorf("CREATE   ints: %3d,  dbls: %3d,  strs: %3d,  vecs: %3d,  maps: %3d  cors: %3d  subs: %3d  slcs: %3d", int_created, dbl_created, str_created, vec_created, map_created, cor_created, sub_created, slc_created);
+    errorf("DESTROY  ints: %3d,  dbls: %3d,  strs: %3d,  vecs: %3d,  maps: %3d  cors: %3d  subs: %3d  slcs: %3d", int_destroyed, dbl_destroyed, str_destroyed, vec_destroyed, map_destroyed, cor_destroyed, sub_destroyed, slc_destroyed);
+    errorf("               %3d,        %3d,        %3d,        %3d,        %3d        %3d        %3d        %3d", int_count-(int_created-int_destroyed), dbl_count-(dbl_created-dbl_destroyed), str_count-(str_created-str_destroyed), vec_count-(vec_created-vec_destroyed), map_count-(map_created-map_destroyed), cor_count-(cor_created-cor_destroyed), sub_count-(sub_created-sub_destroyed), slc_count-(slc_created-slc_destroyed));
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    errorf("PEAK     rss: %ld KB", usage.ru_maxrss);
+  }
+
+  return 0;
+}
+
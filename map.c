@@ -28,6 +28,7 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <stdint.h>
 #include <stdarg.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "arena.h"
 #include "op.h"
@@ -35,6 +36,11 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "vec.h"
 #include "map.h"
 #include "lt.h"
+#include "collect.h"
+#include "io.h"
+#include "sched.h"
+#include "line.h"
+#include "state.h"
 
 map_t*
 map_alloc ()
@@ -60,9 +66,31 @@ map_alloc ()
   map->chains = heap_alloc(sizeof(node_t*) * 17);
   memset(map->chains, 0, sizeof(node_t*) * 17);
 
+  if (++collect_allocs == collect_threshold)
+    collect_pending = 1;
+
+  if (COLLECT_FULL(maps))
+    collect_urge();
+
+  return map;
+}
+
+// the coroutine's scopes vec owns a scope map until map_unscope()
+map_t*
+map_scope ()
+{
+  map_t *map = map_alloc();
+  map->flags = MAP_SCOPE;
   return map;
 }
 
+// drop a reference held by this map
+static void
+map_drop (map_t *map, void *ptr)
+{
+  discard(map->flags & MAP_SCOPE ? ptr: unstore(ptr));
+}
+
 static void
 ensure_map (map_t *map, const char *func)
 {
@@ -79,8 +107,8 @@ map_empty (map_t *map)
     while (map->chains[i])
     {
       node_t *node = map->chains[i];
-      discard(node->key);
-      discard(node->val);
+      map_drop(map, node->key);
+      map_drop(map, node->val);
       map->chains[i] = node->next;
       arena_free(nodes, node);
     }
@@ -123,12 +151,12 @@ map_set (map_t *map, void *key)
     node = arena_alloc(nodes, sizeof(node_t));
     node->next = map->chains[chain];
     map->chains[chain] = node;
-    node->key = copy(key);
+    node->key = map->flags & MAP_SCOPE ? copy(key): store(copy(key));
     map->count++;
   }
   else
   {
-    discard(node->val);
+    map_drop(map, node->val);
   }
   node->val = NULL;
   return &node->val;
@@ -151,6 +179,7 @@ map_incref (map_t *map)
   ensure_map(map, __func__);
 
   map->ref_count++;
+  map->flags &= ~GC_COLOR;
   return map;
 }
 
@@ -160,16 +189,55 @@ map_decref (map_t *map)
   ensure_map(map, __func__);
 
   if (--map->ref_count == 0)
+    collect_zero(map, &map->flags);
+  else
+  if ((map->flags & GC_COLOR) != GC_PURPLE)
+    collect_root(map, &map->flags);
+  return map;
+}
+
+// free a map nothing refers to; a listed map stays behind as a shell for
+// its list to free
+void
+map_free (map_t *map)
+{
+  unsigned int listed = map->flags & (GC_BUFFERED|GC_ZCT);
+  map_empty(map);
+  map_count--;
+  map_destroyed++;
+  if (listed) map->flags = listed|GC_SHELL;
+  else arena_free(maps, map);
+}
+
+// turn a scope into a table by counting its variables
+map_t*
+map_table (map_t *map)
+{
+  ensure_map(map, __func__);
+
+  for (int i = 0; i < 17; i++)
   {
-    map_empty(map);
-    arena_free(maps, map);
-    map_count--;
-    map_destroyed++;
-    map = NULL;
+    for (node_t *node = map->chains[i]; node; node = node->next)
+    {
+      store(node->key);
+      store(node->val);
+    }
   }
+  map->flags &= ~(MAP_SCOPE|MAP_EXPOSED);
   return map;
 }
 
+// A scope leaving its coroutine: nothing else can know of it unless it
+// was exposed, in which case it lives on as a table.
+void
+map_unscope (map_t *map)
+{
+  if (map->flags & MAP_EXPOSED)
+    discard(map_table(map));
+  else
+    map_free(map);
+}
+
 void
 map_chain (map_t *map, map_t *meta)
 {
@@ -29,17 +29,25 @@ typedef struct _node_t {
 
 #define MAP_SMUDGED (1<<0)
 
+// a scope's variables are uncounted references, like the stack's; once a
+// scope has been exposed as a value it becomes a table on the way out
+#define MAP_SCOPE (1<<1)
+#define MAP_EXPOSED (1<<2)
+
 typedef struct _map_t {
   node_t **chains;
   unsigned int flags;
   unsigned int count;
   int ref_count;
+  int crc;
   struct _map_t *meta;
 } map_t;
 
-arena_t *nodes;
-
 map_t* map_alloc ();
+map_t* map_scope ();
+map_t* map_table (map_t*);
+void map_unscope (map_t*);
+void map_free (map_t*);
 map_t* map_empty (map_t*);
 void** map_get (map_t*, void*);
 void** map_set (map_t*, void*);
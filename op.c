@@ -34,6 +34,7 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <float.h>
 #include <sys/stat.h>
 #include <pcre.h>
+#include <pthread.h>
 
 #include "arena.h"
 #include "op.h"
@@ -41,7 +42,16 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "vec.h"
 #include "map.h"
 #include "lt.h"
+#include "collect.h"
 #include "parse.h"
+#include "io.h"
+#include "sched.h"
+#include "ring.h"
+#include "line.h"
+#include "thread.h"
+#include "channel.h"
+#include "parallel.h"
+#include "state.h"
 
 void
 op_nop ()
@@ -56,19 +66,31 @@ op_print ()
 
   for (int i = 0; i < items; i++)
   {
-    char *str = to_char(vec_get(stack(), stack()->count - items + i)[0]);
-    fprintf(stream_output, "%s%s", i ? "\t": "", str);
-    discard(str);
+    if (i) output_write("\t", 1);
+    output_value(vec_get(stack(), stack()->count - items + i)[0]);
   }
-  fprintf(stream_output, "\n");
-  fflush(stream_output);
+  output_write("\n", 1);
+
+  if (output_tty)
+    output_flush();
 }
 
 void
 op_coroutine ()
 {
-  cor_t *cor = cor_incref(cor_alloc());
-  cor->ip = pop_int();
+  void *ptr = pop();
+
+  ensure(is_sub(ptr))
+  {
+    errorf("%s not a function", __func__);
+    stacktrace();
+  }
+
+  cor_t *cor = cor_alloc();
+  cor->ip = get_sub(ptr);
+  // the body's scope, as op_call would make; its return unscopes it
+  vec_push(cor->scopes)[0] = map_scope();
+  discard(ptr);
   push(cor);
 }
 
@@ -80,9 +102,18 @@ op_resume ()
 
   if (cor->state == COR_DEAD)
   {
+    while (depth()) op_drop();
     push(to_bool(0));
     push(strf("cannot resume dead coroutine"));
-    discard(cor);
+    return;
+  }
+
+  // already somewhere in the resume chain
+  if (cor->state == COR_RUNNING)
+  {
+    while (depth()) op_drop();
+    push(to_bool(0));
+    push(strf("cannot resume running coroutine"));
     return;
   }
 
@@ -94,7 +125,7 @@ op_resume ()
     vec_push(cor->stack)[0] = item(i)[0];
 
   stack()->count -= depth();
-  routines[routine_count++] = cor;
+  routine_push(cor);
 }
 
 void
@@ -102,15 +133,16 @@ op_yield ()
 {
   int items = depth();
 
-  cor_t *src = routine();
-  routine_count--;
+  cor_t *src = routine_pop();
   cor_t *dst = routine();
 
   for (int i = 0; i < items; i++)
     push(vec_get(src->stack, src->stack->count - items + i)[0]);
 
   src->stack->count -= items;
-  src->state = COR_SUSPENDED;
+  if (src->state == COR_RUNNING)
+    src->state = COR_SUSPENDED;
+
   ivec_cell(&dst->marks, -1)[0] += items;
 
   discard(src);
@@ -137,10 +169,12 @@ op_call ()
   discard(ptr);
 }
 
+static void find (int);
+
 void
 op_call_lit ()
 {
-  op_find_lit();
+  find(0);
   op_call();
 }
 
@@ -168,21 +202,25 @@ op_return ()
 void
 op_reply ()
 {
-  routine()->marks.count = ivec_cell(&routine()->calls, -2)[0];
-  routine()->loops.count = ivec_cell(&routine()->calls, -3)[0];
+  // a coroutine's outermost function has no call frame; unwind to the
+  // mark pushed by cor_alloc
+  int calls = routine()->calls.count;
+  routine()->marks.count = calls ? ivec_cell(&routine()->calls, -2)[0]: 1;
+  routine()->loops.count = calls ? ivec_cell(&routine()->calls, -3)[0]: 0;
   while (depth()) op_drop();
 }
 
 void
 op_lit ()
 {
-  push(copy(code[routine()->ip-1].ptr));
+  code_t *c = &code[routine()->ip-1];
+  push(c->offset & BORROW_PUSH ? c->ptr: copy(c->ptr));
 }
 
 void
 op_scope ()
 {
-  vec_push(routine()->scopes)[0] = map_incref(map_alloc());
+  vec_push(routine()->scopes)[0] = map_scope();
 }
 
 void
@@ -194,12 +232,12 @@ op_smudge ()
 void
 op_litstack ()
 {
-  vec_t *vec = vec_incref(vec_alloc());
+  vec_t *vec = vec_alloc();
 
   int items = depth();
 
   for (int i = 0; i < items; i++)
-    vec_push(vec)[0] = vec_get(stack(), stack()->count - items + i)[0];
+    vec_push(vec)[0] = store(vec_get(stack(), stack()->count - items + i)[0]);
 
   stack()->count -= items;
 
@@ -209,7 +247,7 @@ op_litstack ()
 void
 op_unscope ()
 {
-  discard(vec_pop(routine()->scopes));
+  map_unscope(vec_pop(routine()->scopes));
 }
 
 void
@@ -217,7 +255,7 @@ op_litscope ()
 {
   map_t *map = vec_pop(routine()->scopes);
   map->flags &= ~MAP_SMUDGED;
-  push(map);
+  push(map_table(map));
 }
 
 void
@@ -259,6 +297,9 @@ op_limit ()
     while (req_depth < stack()->count) op_drop();
     while (req_depth > stack()->count) push(NULL);
   }
+
+  if (collect_pending)
+    collect_safepoint();
 }
 
 void
@@ -298,13 +339,15 @@ op_table ()
 void
 op_global ()
 {
-  push(copy(scope_global));
+  push(scope_global);
 }
 
 void
 op_local ()
 {
-  push(copy(scope_reading()));
+  map_t *map = scope_reading();
+  map->flags |= MAP_EXPOSED;
+  push(map);
 }
 
 void
@@ -463,14 +506,42 @@ op_for ()
       void *key = vec_pop(keys);
 
       if (vars->count > 1)
-        map_set(scope_writing(), vec_get(vars, var++)[0])[0] = key;
+        map_set(scope_writing(), vec_get(vars, var++)[0])[0] = unstore(key);
 
-      map_set(scope_writing(), vec_get(vars, var++)[0])[0] = map_get(iter, key)[0];
+      map_set(scope_writing(), vec_get(vars, var++)[0])[0] = copy(map_get(iter, key)[0]);
 
       push(keys);
     }
   }
   else
+  if (is_io(iter))
+  {
+    int step = get_int(item);
+    discard(item);
+
+    char *line = io_line(iter);
+
+    if (!line && (((io_t*)iter)->flags & IO_WAIT))
+    {
+      push_int(step);
+      io_park(iter, 0);
+      return;
+    }
+
+    if (!line)
+    {
+      routine()->ip = code[routine()->ip-1].offset;
+    }
+    else
+    {
+      if (vars->count > 1)
+        map_set(scope_writing(), vec_get(vars, var++)[0])[0] = to_int(step);
+
+      map_set(scope_writing(), vec_get(vars, var++)[0])[0] = line;
+      push_int(++step);
+    }
+  }
+  else
   {
     routine()->ip = code[routine()->ip-1].offset;
     discard(item);
@@ -489,6 +560,7 @@ op_keys ()
 
   op_litstack();
   ivec_pop(&routine()->marks);
+  discard(map);
 }
 
 void
@@ -503,6 +575,26 @@ op_values ()
 
   op_litstack();
   ivec_pop(&routine()->marks);
+  discard(map);
+}
+
+// The value of an assignment statement is dropped right after by OP_LIMIT,
+// so move it into place instead of copying it.
+static void*
+assigned (int index)
+{
+  if (index >= depth())
+    return NULL;
+
+  void **slot = item(index);
+  code_t *next = &code[routine()->ip];
+
+  if (next->op != OP_LIMIT || next->offset != 0)
+    return copy(slot[0]);
+
+  void *val = slot[0];
+  slot[0] = NULL;
+  return val;
 }
 
 void
@@ -510,8 +602,7 @@ op_assign ()
 {
   void *key = pop();
   int index = code[routine()->ip-1].offset;
-  void *val = index < depth() ? item(index)[0]: NULL;
-  map_set(scope_writing(), key)[0] = copy(val);
+  map_set(scope_writing(), key)[0] = assigned(index);
   discard(key);
 }
 
@@ -519,64 +610,84 @@ void
 op_assign_lit ()
 {
   int index = code[routine()->ip-1].offset;
-  void *val = index < depth() ? item(index)[0]: NULL;
-  map_set(scope_writing(), code[routine()->ip-1].ptr)[0] = copy(val);
+  map_set(scope_writing(), code[routine()->ip-1].ptr)[0] = assigned(index);
 }
 
 void
 op_find ()
 {
-  char *key = pop();
+  void *key = pop();
   void **ptr = map_get(scope_reading(), key);
   if (!ptr) ptr = map_get(scope_global, key);
   if (!ptr) ptr = map_get(scope_core, key);
-  if (!ptr && !strcmp(key, "global")) { op_global(); goto done; }
-  if (!ptr && !strcmp(key, "local")) { op_local(); goto done; }
+  if (!ptr && equal_str(key, "global")) { op_global(); goto done; }
+  if (!ptr && equal_str(key, "local")) { op_local(); goto done; }
   push(ptr ? copy(ptr[0]): NULL);
 done:
   discard(key);
 }
 
-void
-op_find_lit ()
+static void
+find (int borrow)
 {
-  char *key = code[routine()->ip-1].ptr;
+  void *key = code[routine()->ip-1].ptr;
   void **ptr = map_get(scope_reading(), key);
   if (!ptr) ptr = map_get(scope_global, key);
   if (!ptr) ptr = map_get(scope_core, key);
-  if (!ptr && !strcmp(key, "global")) { op_global(); return; }
-  if (!ptr && !strcmp(key, "local")) { op_local(); return; }
 
-  ensure(ptr)
+  void *val = ptr ? ptr[0]: NULL;
+
+  if (!ptr && equal_str(key, "global")) val = scope_global;
+  else if (!ptr && equal_str(key, "local")) { op_local(); return; }
+  else ensure(ptr)
   {
-    errorf("what? %s", key);
+    errorf("what? %.*s", (int)count(key), get_str(key));
     stacktrace();
   }
-  push(ptr ? copy(ptr[0]): NULL);
+  push(borrow ? val: copy(val));
 }
 
 void
-op_set ()
+op_find_lit ()
+{
+  find(code[routine()->ip-1].offset & BORROW_PUSH);
+}
+
+static void
+set (void *dst, void *key)
 {
-  void *key = pop();
-  void *dst = pop();
   int index = code[routine()->ip-1].offset;
-  void *val = index < depth() ? item(index)[0]: NULL;
 
   if (is_vec(dst) && is_int(key))
   {
-    vec_set(dst, get_int(key))[0] = copy(val);
+    vec_set(dst, get_int(key))[0] = store(assigned(index));
   }
   else
   if (is_map(dst) && key)
   {
-    map_set(dst, key)[0] = copy(val);
+    void *val = assigned(index);
+    map_set(dst, key)[0] = ((map_t*)dst)->flags & MAP_SCOPE ? val: store(val);
   }
+}
 
+void
+op_set ()
+{
+  void *key = pop();
+  void *dst = pop();
+  set(dst, key);
   discard(key);
   discard(dst);
 }
 
+void
+op_set_lit ()
+{
+  void *dst = pop();
+  set(dst, code[routine()->ip-1].ptr);
+  discard(dst);
+}
+
 void
 op_inherit ()
 {
@@ -587,13 +698,64 @@ op_inherit ()
   discard(src);
 }
 
+// A consumer's operands may be borrowed from a literal or variable, see
+// code_borrow(); those are not its to discard.
+static void
+release (void *ptr, int operand)
+{
+  if (!(code[routine()->ip-1].offset & operand))
+    discard(ptr);
+}
+
+static int64_t
+int_operand (int operand)
+{
+  void *ptr = pop();
+  int64_t n = get_int(ptr);
+  release(ptr, operand);
+  return n;
+}
+
+static double
+dbl_operand (int operand)
+{
+  void *ptr = pop();
+  double n = get_dbl(ptr);
+  release(ptr, operand);
+  return n;
+}
+
+// Numbers are never shared, so like OP_ADD_LIT the left operand of binary
+// arithmetic is overwritten in place unless it is borrowed.
+static int64_t*
+int_result ()
+{
+  void **slot = vec_get(stack(), stack()->count-1);
+
+  if (code[routine()->ip-1].offset & BORROW_UNDER)
+    slot[0] = to_int(get_int(slot[0]));
+
+  return slot[0];
+}
+
+static double*
+dbl_result ()
+{
+  void **slot = vec_get(stack(), stack()->count-1);
+
+  if (code[routine()->ip-1].offset & BORROW_UNDER)
+    slot[0] = to_dbl(get_dbl(slot[0]));
+
+  return slot[0];
+}
+
 void
 op_get ()
 {
   void *key = pop();
   void *src = pop();
 
-  if (is_str(src) && is_str(key))
+  if (is_text(src) && is_text(key))
   {
     void **ptr = map_get(super_str, key);
     push(ptr ? copy(ptr[0]): NULL);
@@ -613,8 +775,8 @@ op_get ()
   else
     push(NULL);
 
-  discard(key);
-  discard(src);
+  release(key, BORROW_TOP);
+  release(src, BORROW_UNDER);
 }
 
 void
@@ -623,7 +785,7 @@ op_get_lit ()
   void *key = code[routine()->ip-1].ptr;
   void *src = pop();
 
-  if (is_str(src) && is_str(key))
+  if (is_text(src) && is_text(key))
   {
     void **ptr = map_get(super_str, key);
     push(ptr ? copy(ptr[0]): NULL);
@@ -643,17 +805,17 @@ op_get_lit ()
   else
     push(NULL);
 
-  discard(src);
+  release(src, BORROW_TOP);
 }
 
 void
 op_add ()
 {
   if (is_int(under()))
-    push_int(pop_int()+pop_int());
+    { int64_t b = int_operand(BORROW_TOP); int_result()[0] += b; }
   else
   if (is_dbl(under()))
-    push_dbl(pop_dbl()+pop_dbl());
+    { double b = dbl_operand(BORROW_TOP); dbl_result()[0] += b; }
   else
   {
     stacktrace();
@@ -694,18 +856,26 @@ op_neg ()
 void
 op_sub ()
 {
-  op_neg();
-  op_add();
+  if (is_int(under()))
+    { int64_t b = int_operand(BORROW_TOP); int_result()[0] -= b; }
+  else
+  if (is_dbl(under()))
+    { double b = dbl_operand(BORROW_TOP); dbl_result()[0] -= b; }
+  else
+  {
+    stacktrace();
+    ensure(0);
+  }
 }
 
 void
 op_mul ()
 {
   if (is_int(under()))
-    push_int(pop_int()*pop_int());
+    { int64_t b = int_operand(BORROW_TOP); int_result()[0] *= b; }
   else
   if (is_dbl(under()))
-    push_dbl(pop_dbl()*pop_dbl());
+    { double b = dbl_operand(BORROW_TOP); dbl_result()[0] *= b; }
   else
   {
     stacktrace();
@@ -717,10 +887,10 @@ void
 op_div ()
 {
   if (is_int(under()))
-    { int64_t b = pop_int(), a = pop_int(); push_int(a/b); }
+    { int64_t b = int_operand(BORROW_TOP); int_result()[0] /= b; }
   else
   if (is_dbl(under()))
-    { double b = pop_dbl(), a = pop_dbl(); push_dbl(a/b); }
+    { double b = dbl_operand(BORROW_TOP); dbl_result()[0] /= b; }
   else
   {
     stacktrace();
@@ -732,7 +902,7 @@ void
 op_mod ()
 {
   if (is_int(under()))
-    { int64_t b = pop_int(), a = pop_int(); push_int(a%b); }
+    { int64_t b = int_operand(BORROW_TOP); int_result()[0] %= b; }
   else
   {
     stacktrace();
@@ -746,15 +916,18 @@ op_eq ()
   void *b = pop();
   void *a = pop();
   push_flag(equal(a, b));
-  discard(a);
-  discard(b);
+  release(a, BORROW_UNDER);
+  release(b, BORROW_TOP);
 }
 
 void
 op_ne ()
 {
-  op_eq();
-  op_not();
+  void *b = pop();
+  void *a = pop();
+  push_flag(!equal(a, b));
+  release(a, BORROW_UNDER);
+  release(b, BORROW_TOP);
 }
 
 void
@@ -763,8 +936,8 @@ op_lt ()
   void *b = pop();
   void *a = pop();
   push_flag(less(a, b));
-  discard(a);
-  discard(b);
+  release(a, BORROW_UNDER);
+  release(b, BORROW_TOP);
 }
 
 void
@@ -772,7 +945,7 @@ op_lt_lit ()
 {
   void *a = pop();
   push_flag(less(a, code[routine()->ip-1].ptr));
-  discard(a);
+  release(a, BORROW_TOP);
 }
 
 void
@@ -781,8 +954,8 @@ op_gt ()
   void *b = pop();
   void *a = pop();
   push_flag(!(less(a, b) || equal(a, b)));
-  discard(a);
-  discard(b);
+  release(a, BORROW_UNDER);
+  release(b, BORROW_TOP);
 }
 
 void
@@ -791,8 +964,8 @@ op_lte ()
   void *b = pop();
   void *a = pop();
   push_flag(less(a, b) || equal(a, b));
-  discard(a);
-  discard(b);
+  release(a, BORROW_UNDER);
+  release(b, BORROW_TOP);
 }
 
 void
@@ -801,14 +974,16 @@ op_gte ()
   void *b = pop();
   void *a = pop();
   push_flag(!less(a, b));
-  discard(a);
-  discard(b);
+  release(a, BORROW_UNDER);
+  release(b, BORROW_TOP);
 }
 
 void
 op_not ()
 {
-  push_flag(pop_bool() == 0);
+  void *a = pop();
+  push_flag(!truth(a));
+  release(a, BORROW_TOP);
 }
 
 void
@@ -819,8 +994,8 @@ op_concat ()
   char *bs = to_char(b);
   char *as = to_char(a);
   push(strf("%s%s", as, bs));
-  discard(a);
-  discard(b);
+  release(a, BORROW_UNDER);
+  release(b, BORROW_TOP);
   discard(as);
   discard(bs);
 }
@@ -830,24 +1005,43 @@ op_count ()
 {
   void *a = pop();
   push_int(count(a));
-  discard(a);
+  release(a, BORROW_TOP);
 }
 
 void
 op_match()
 {
-  const char *pattern = pop();
-  const char *subject = pop();
+  void *pattern = pop();
+  void *subject = pop();
+
+  // captures are slices sharing the subject's bytes
+  slc_t *slc = subject;
+
+  if (is_str(subject))
+    slc = slc_incref(slc_alloc(subject));
+  else
+  if (!is_slc(subject))
+  {
+    slc = slc_incref(slc_alloc(to_char(subject)));
+    discard(subject);
+  }
+
+  char *pstr = is_str(pattern) ? pattern: to_char(pattern);
 
   const char *error;
   int erroffset;
-  int ovector[100];
+  int ovector[99];
   pcre_extra *extra = NULL;
 
-  pcre *re = pcre_compile(pattern, PCRE_DOTALL|PCRE_UTF8, &error, &erroffset, 0);
+  pcre *re = pcre_compile(pstr, PCRE_DOTALL|PCRE_UTF8, &error, &erroffset, 0);
+
+  if (pstr != pattern)
+    discard(pstr);
+  discard(pattern);
 
   if (!re)
   {
+    discard(slc);
     return;
   }
 
@@ -858,64 +1052,457 @@ op_match()
   if (!extra && error)
   {
     pcre_free(re);
+    discard(slc);
     return;
   }
 #endif
 
-  int matches = pcre_exec(re, extra, subject, strlen(subject), 0, 0, ovector, sizeof(ovector));
+  int matches = pcre_exec(re, extra, get_str(slc), count(slc), 0, 0, ovector, sizeof(ovector)/sizeof(int));
 
   if (matches < 0)
   {
     if (extra)
       pcre_free(extra);
     pcre_free(re);
+    discard(slc);
     return;
   }
 
   if (matches == 0)
   {
-    matches = sizeof(ovector)/3;
+    matches = sizeof(ovector)/sizeof(int)/3;
   }
 
-  char *buffer = heap_alloc(strlen(subject)+1);
-
   for (int i = 0; i < matches; i++)
   {
     int offset = ovector[2*i];
     int length = ovector[2*i+1] - offset;
-    memmove(buffer, subject+offset, length);
-    buffer[length] = 0;
-    push(substr(buffer, 0, length));
+    push(offset < 0 ? NULL: slc_incref(slc_sub(slc, offset, length)));
   }
 
-  heap_free(buffer);
+  discard(slc);
 
   if (extra)
     pcre_free(extra);
   pcre_free(re);
 }
 
+typedef struct {
+  const char *name;
+  arena_t *pool;
+} status_arena_t;
+
+static void
+status_set (map_t *status, const char *name, const char *field, int64_t value)
+{
+  char *key = strf("%s_%s", name, field);
+  map_set(status, key)[0] = to_int(value);
+  discard(key);
+}
+
+// all counters are maintained by the arenas, so this is cheap enough to
+// poll; only largest/runs rescan, and only after changes
 void
 op_status ()
 {
-  map_t *status = map_incref(map_alloc());
-  map_set_str(status, "heap_mem")[0] = to_int(heap_mem);
-  map_set_str(status, "heap_limit")[0] = to_int(heap->pages);
-  map_set_str(status, "heap_used")[0] = to_int(arena_usage(heap));
-  map_set_str(status, "ints_mem")[0] = to_int(ints_mem);
-  map_set_str(status, "ints_limit")[0] = to_int(ints->pages);
-  map_set_str(status, "ints_used")[0] = to_int(arena_usage(ints));
-  map_set_str(status, "dbls_mem")[0] = to_int(dbls_mem);
-  map_set_str(status, "dbls_limit")[0] = to_int(dbls->pages);
-  map_set_str(status, "dbls_used")[0] = to_int(arena_usage(dbls));
-  map_set_str(status, "strs_mem")[0] = to_int(strs_mem);
-  map_set_str(status, "strs_limit")[0] = to_int(strs->pages);
-  map_set_str(status, "strs_used")[0] = to_int(arena_usage(strs));
-  map_set_str(status, "vecs_mem")[0] = to_int(vecs_mem);
-  map_set_str(status, "vecs_limit")[0] = to_int(vecs->pages);
-  map_set_str(status, "vecs_used")[0] = to_int(arena_usage(vecs));
-  map_set_str(status, "maps_mem")[0] = to_int(maps_mem);
-  map_set_str(status, "maps_limit")[0] = to_int(maps->pages);
-  map_set_str(status, "maps_used")[0] = to_int(arena_usage(maps));
+  map_t *status = map_alloc();
+
+  status_arena_t status_arenas[] = {
+    { .name = "heap",  .pool = heap  },
+    { .name = "ints",  .pool = ints  },
+    { .name = "dbls",  .pool = dbls  },
+    { .name = "strs",  .pool = strs  },
+    { .name = "slcs",  .pool = slcs  },
+    { .name = "vecs",  .pool = vecs  },
+    { .name = "maps",  .pool = maps  },
+    { .name = "nodes", .pool = nodes },
+    { .name = "cors",  .pool = cors  },
+    { .name = "subs",  .pool = subs  },
+    { .name = "ios",   .pool = ios   },
+    { .name = "chans", .pool = chans },
+  };
+
+  for (int i = 0; i < sizeof(status_arenas) / sizeof(status_arena_t); i++)
+  {
+    const char *name = status_arenas[i].name;
+    arena_t *arena = status_arenas[i].pool;
+
+    if (!arena) continue;
+
+    status_set(status, name, "mem", arena->bytes);
+    status_set(status, name, "limit", arena->pages);
+    status_set(status, name, "used", arena->used);
+    status_set(status, name, "peak", arena->peak);
+    status_set(status, name, "allocs", arena->allocs);
+    status_set(status, name, "frees", arena->frees);
+    status_set(status, name, "failures", arena->failures);
+    status_set(status, name, "largest", arena_largest(arena));
+    status_set(status, name, "runs", arena_runs(arena));
+  }
+
+  status_set(status, "cors", "pooled", cor_pool_count());
+  status_set(status, "sched", "tasks", sched_tasks());
+  status_set(status, "sched", "waiting", sched_waiting());
+  status_set(status, "ring", "enabled", ring_enabled && ring_fd >= 0);
+  status_set(status, "ring", "reads", ring_reads);
+  status_set(status, "ring", "submits", ring_submits);
+  status_set(status, "collect", "runs", collect_runs);
+  status_set(status, "collect", "freed", collect_freed);
+  status_set(status, "collect", "roots", collect_count());
+  status_set(status, "collect", "slices", collect_slices);
+  status_set(status, "collect", "deferred", collect_deferred());
+  status_set(status, "collect", "reconciles", collect_reconciles);
+  status_set(status, "collect", "reclaimed", collect_reclaimed);
+  status_set(status, "collect", "pause_us", collect_pause_total);
+  status_set(status, "collect", "pause_max_us", collect_pause_max);
+  status_set(status, "collect", "pause_last_us", collect_pause_last);
+
   push(status);
 }
+
+void
+op_flush ()
+{
+  output_flush();
+}
+
+void
+op_mmap ()
+{
+  void *path = pop();
+  char *str = is_str(path) ? path: to_char(path);
+  slc_t *slc = slc_mmap(str);
+  push(slc ? slc_incref(slc): NULL);
+  if (str != path)
+    discard(str);
+  discard(path);
+}
+
+void
+op_read ()
+{
+  io_t *io = io_incref(stream_input);
+  int bytes = -1;
+
+  for (int i = 0, items = depth(); i < items; i++)
+  {
+    void *arg = item(i)[0];
+    if (is_io(arg)) { discard(io); io = io_incref(arg); }
+    if (is_int(arg)) bytes = get_int(arg);
+  }
+
+  char *data = bytes < 0 ? io_line(io): io_read(io, bytes);
+
+  // nothing yet; the task parks and reads again when it can
+  if (io->flags & IO_WAIT)
+  {
+    io_park(io, 0);
+    discard(io);
+    return;
+  }
+
+  while (depth()) op_drop();
+
+  push(data);
+  discard(io);
+}
+
+// io.write(io, value) returns the bytes written, or nil on error
+void
+op_write ()
+{
+  io_t *io = depth() ? item(0)[0]: NULL;
+  ensure(is_io(io)) errorf("%s not an io_t", __func__);
+
+  void *data = depth() > 1 ? item(1)[0]: NULL;
+  char *str = is_text(data) ? NULL: to_char(data);
+
+  int written = str
+    ? io_write(io, str, strlen(str))
+    : io_write(io, get_str(data), count(data));
+
+  discard(str);
+
+  if (io->flags & IO_WAIT)
+  {
+    io_park(io, 1);
+    return;
+  }
+
+  while (depth()) op_drop();
+
+  push(written < 0 ? NULL: to_int(written));
+}
+
+static void
+push_pair (int rc, io_t **pair)
+{
+  while (depth()) op_drop();
+
+  push(rc < 0 ? NULL: io_incref(pair[0]));
+  push(rc < 0 ? NULL: io_incref(pair[1]));
+}
+
+// r, w = io.pipe()
+void
+op_pipe ()
+{
+  io_t *pair[2];
+  push_pair(io_pipe(pair), pair);
+}
+
+void
+op_socketpair ()
+{
+  io_t *pair[2];
+  push_pair(io_socketpair(pair), pair);
+}
+
+// io.spawn(function, args...) makes a task for io.run() to resume; the
+// arguments are passed as by the first resume
+void
+op_spawn ()
+{
+  int items = depth();
+  void *ptr = item(0)[0];
+
+  ensure(is_sub(ptr))
+  {
+    errorf("%s not a function", __func__);
+    stacktrace();
+  }
+
+  cor_t *cor = cor_alloc();
+  cor->ip = get_sub(ptr);
+  vec_push(cor->scopes)[0] = map_scope();
+
+  for (int i = 1; i < items; i++)
+    vec_push(cor->stack)[0] = item(i)[0];
+
+  stack()->count -= items - 1;
+  discard(pop());
+
+  sched_spawn(cor);
+  push(cor);
+}
+
+// io.run() resumes tasks until all have finished. It is rewound each time
+// it resumes one, so it runs again whenever a task yields, parks or dies.
+void
+op_run ()
+{
+  while (depth()) op_drop();
+
+  cor_t *cor = sched_next();
+  if (!cor) return;
+
+  routine()->ip--;
+  cor->state = COR_RUNNING;
+  routine_push(cor);
+}
+
+// thread.spawn(script or function, ...) starts an interpreter on a new
+// thread and returns its handle; a function's arguments go as messages
+void
+op_thread ()
+{
+  int items = depth();
+
+  ensure(items > 0)
+  {
+    errorf("thread.spawn: expected a script path or a function");
+    stacktrace();
+  }
+
+  int handle = thread_spawn(item(0)[0], items - 1);
+
+  while (depth()) op_drop();
+  push_int(handle);
+}
+
+// thread.join(handle) waits for a thread and returns what its function
+// returned
+void
+op_join ()
+{
+  void *ptr = depth() ? item(0)[0]: NULL;
+
+  ensure(is_int(ptr))
+  {
+    errorf("thread.join: expected a thread handle");
+    stacktrace();
+  }
+
+  int handle = get_int(ptr);
+  while (depth()) op_drop();
+
+  ensure(thread_join(handle))
+  {
+    errorf("thread.join: no thread %d", handle);
+    stacktrace();
+  }
+}
+
+// the channel argument of a channel.* call
+static chan_t*
+channel_arg (const char *name, int args)
+{
+  void *ptr = depth() ? item(0)[0]: NULL;
+
+  ensure(is_chan(ptr) && depth() >= args)
+  {
+    errorf("channel.%s: expected a channel%s", name, args > 1 ? " and a value": "");
+    stacktrace();
+  }
+
+  return ptr;
+}
+
+// channel.new(capacity) makes a queue that holds up to capacity messages
+// before senders wait; the default is 1
+void
+op_channel ()
+{
+  void *ptr = depth() ? item(0)[0]: NULL;
+
+  ensure(!ptr || (is_int(ptr) && get_int(ptr) > 0))
+  {
+    errorf("channel.new: expected a positive capacity");
+    stacktrace();
+  }
+
+  int capacity = ptr ? get_int(ptr): 1;
+  while (depth()) op_drop();
+
+  push(chan_incref(chan_alloc(channel_open(capacity))));
+}
+
+static void
+channel_put (const char *name, int block)
+{
+  chan_t *chan = channel_arg(name, 2);
+  int status = channel_send(chan, item(1)[0], block);
+
+  while (depth()) op_drop();
+  push_bool(status == CHANNEL_OK);
+}
+
+static void
+channel_take (const char *name, int block)
+{
+  chan_t *chan = chan_incref(channel_arg(name, 1));
+  while (depth()) op_drop();
+
+  void *value;
+  int status = channel_recv(chan, &value, block);
+  chan_decref(chan);
+
+  push(value);
+  push_bool(status == CHANNEL_OK);
+}
+
+// channel.send(c, value) waits for space; false once the channel is closed
+void
+op_send ()
+{
+  channel_put("send", 1);
+}
+
+// channel.try_send(c, value) is false when the channel is full or closed
+void
+op_try_send ()
+{
+  channel_put("try_send", 0);
+}
+
+// value, ok = channel.recv(c) waits for a message; ok is false once the
+// channel is closed and drained
+void
+op_recv ()
+{
+  channel_take("recv", 1);
+}
+
+// value, ok = channel.try_recv(c); ok is false when nothing is waiting
+void
+op_try_recv ()
+{
+  channel_take("try_recv", 0);
+}
+
+void
+op_close ()
+{
+  channel_close(channel_arg("close", 1));
+  while (depth()) op_drop();
+}
+
+// parallel.map(array, f) is an array of f(item) for each item, computed
+// on a pool of interpreters; f sees only global functions
+void
+op_parallel_map ()
+{
+  void *array = depth() > 0 ? item(0)[0]: NULL;
+  void *func = depth() > 1 ? item(1)[0]: NULL;
+
+  ensure(is_vec(array) && is_sub(func))
+  {
+    errorf("parallel.map: expected an array and a function");
+    stacktrace();
+  }
+
+  vec_t *out = vec_alloc();
+  push(out);
+
+  parallel_map(array, get_sub(func), out);
+
+  out = pop();
+  while (depth()) op_drop();
+  push(out);
+}
+
+// parallel.reduce(array, f[, init]) folds array with an associative f
+void
+op_parallel_reduce ()
+{
+  void *array = depth() > 0 ? item(0)[0]: NULL;
+  void *func = depth() > 1 ? item(1)[0]: NULL;
+
+  ensure(is_vec(array) && is_sub(func))
+  {
+    errorf("parallel.reduce: expected an array and a function");
+    stacktrace();
+  }
+
+  void *value = parallel_reduce(array, get_sub(func), depth() > 2 ? item(2): NULL);
+
+  while (depth()) op_drop();
+  push(value);
+}
+
+void
+op_lines ()
+{
+  void *path = depth() ? item(0)[0]: NULL;
+  io_t *io = stream_input;
+
+  if (path)
+  {
+    char *str = is_str(path) ? path: to_char(path);
+    io = io_open(str);
+    if (str != path)
+      discard(str);
+  }
+
+  while (depth()) op_drop();
+
+  push(io ? io_incref(io): NULL);
+}
+
+// collect cycles now; returns the number of objects freed
+void
+op_collect ()
+{
+  while (depth()) op_drop();
+  push_int(collect());
+}
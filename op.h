@@ -71,6 +71,7 @@ void op_find ();
 void op_find_lit ();
 void op_inherit ();
 void op_set ();
+void op_set_lit ();
 void op_get ();
 void op_get_lit ();
 void op_add ();
@@ -92,6 +93,26 @@ void op_concat ();
 void op_count ();
 void op_match ();
 void op_status ();
+void op_flush ();
+void op_mmap ();
+void op_read ();
+void op_lines ();
+void op_collect ();
+void op_write ();
+void op_pipe ();
+void op_socketpair ();
+void op_spawn ();
+void op_run ();
+void op_thread ();
+void op_join ();
+void op_channel ();
+void op_send ();
+void op_try_send ();
+void op_recv ();
+void op_try_recv ();
+void op_close ();
+void op_parallel_map ();
+void op_parallel_reduce ();
 
 enum {
   OP_NOP=1,
@@ -144,6 +165,7 @@ enum {
   OP_FIND,
   OP_FIND_LIT,
   OP_SET,
+  OP_SET_LIT,
   OP_INHERIT,
   OP_GET,
   OP_GET_LIT,
@@ -167,6 +189,26 @@ enum {
   OP_COUNT,
   OP_MATCH,
   OP_STATUS,
+  OP_FLUSH,
+  OP_MMAP,
+  OP_READ,
+  OP_LINES,
+  OP_COLLECT,
+  OP_WRITE,
+  OP_PIPE,
+  OP_SOCKETPAIR,
+  OP_SPAWN,
+  OP_RUN,
+  OP_THREAD,
+  OP_JOIN,
+  OP_CHANNEL,
+  OP_SEND,
+  OP_TRY_SEND,
+  OP_RECV,
+  OP_TRY_RECV,
+  OP_CLOSE,
+  OP_PARALLEL_MAP,
+  OP_PARALLEL_REDUCE,
 
   OP_CUSTOM
 };
@@ -0,0 +1,434 @@
+/*
+Copyright (c) 2016 Sean Pringle sean.pringle@gmail.com
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "arena.h"
+#include "op.h"
+#include "str.h"
+#include "vec.h"
+#include "map.h"
+#include "parse.h"
+#include "lt.h"
+#include "collect.h"
+#include "io.h"
+#include "sched.h"
+#include "line.h"
+#include "thread.h"
+#include "parallel.h"
+#include "state.h"
+
+enum {
+  JOB_MAP = 1,
+  JOB_REDUCE,
+};
+
+// Worker 0 is the calling interpreter. Each worker starts on its own run
+// of chunks [lo, hi) and, once that is done, steals the upper half of the
+// longest run left, so a slow chunk holds up only its own worker.
+typedef struct {
+  struct pool *pool;
+  pthread_t thread;
+  int index;
+  int lo;
+  int hi;
+} worker_t;
+
+// One pool per interpreter, opened at its first parallel call and kept
+// until lt_close(). The job fields are written by worker 0 before it
+// bumps job, and read by the others after they see it change.
+typedef struct pool {
+  image_t image;
+  int workers;
+  worker_t *worker;
+  pthread_mutex_t mutex;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  int job;
+  int busy;
+  int quit;
+
+  int kind;
+  int64_t entry;
+  msg_t functions;
+  msg_t input;
+  int *offsets;
+  int offset_limit;
+  int items;
+  int grain;
+  int chunks;
+  msg_t *results;
+  int result_limit;
+} pool_t;
+
+static int
+pool_take (pool_t *pool, int index, int *chunk)
+{
+  pthread_mutex_lock(&pool->mutex);
+
+  worker_t *own = &pool->worker[index];
+
+  if (own->lo == own->hi)
+  {
+    worker_t *victim = NULL;
+
+    for (int i = 0; i < pool->workers; i++)
+    {
+      worker_t *worker = &pool->worker[i];
+      if (worker->hi - worker->lo > (victim ? victim->hi - victim->lo: 0))
+        victim = worker;
+    }
+
+    if (victim)
+    {
+      own->hi = victim->hi;
+      own->lo = victim->hi - (victim->hi - victim->lo + 1) / 2;
+      victim->hi = own->lo;
+    }
+  }
+
+  int found = own->lo < own->hi;
+  if (found) *chunk = own->lo++;
+
+  pthread_mutex_unlock(&pool->mutex);
+  return found;
+}
+
+// item i: worker 0 reads the array itself, others their copy of it
+static void*
+pool_item (pool_t *pool, vec_t *array, int i)
+{
+  if (array)
+    return copy(vec_get(array, i)[0]);
+
+  int offset = pool->offsets[i];
+  return msg_unpack(&pool->input, &offset);
+}
+
+// Map a chunk into out, or pack the results when out is NULL; reduce a
+// chunk, left to right, to one packed value.
+static void
+pool_chunk (pool_t *pool, int chunk, vec_t *array, vec_t *out)
+{
+  int from = chunk * pool->grain;
+  int to = from + pool->grain < pool->items ? from + pool->grain: pool->items;
+
+  msg_t *result = &pool->results[chunk];
+  msg_clear(result);
+
+  op_mark();
+
+  if (pool->kind == JOB_MAP)
+  {
+    for (int i = from; i < to; i++)
+    {
+      push(pool_item(pool, array, i));
+
+      if (!call(pool->entry, 1))
+        push(NULL);
+
+      while (depth() > 1) op_drop();
+
+      if (out)
+        vec_get(out, i)[0] = store(pop());
+      else
+        msg_pack(result, item(0)[0]);
+
+      while (depth()) op_drop();
+    }
+  }
+  else
+  {
+    push(pool_item(pool, array, from));
+
+    for (int i = from+1; i < to; i++)
+    {
+      push(pool_item(pool, array, i));
+
+      if (!call(pool->entry, 2))
+        push(NULL);
+
+      while (depth() > 1) op_drop();
+    }
+
+    msg_pack(result, item(0)[0]);
+    while (depth()) op_drop();
+  }
+
+  op_unmark();
+}
+
+static void*
+pool_main (void *arg)
+{
+  worker_t *worker = arg;
+  pool_t *pool = worker->pool;
+
+  image_open(&pool->image);
+
+  int job = 0;
+
+  pthread_mutex_lock(&pool->mutex);
+
+  for (;;)
+  {
+    while (pool->job == job && !pool->quit)
+      pthread_cond_wait(&pool->start, &pool->mutex);
+
+    if (pool->quit)
+      break;
+
+    job = pool->job;
+    pthread_mutex_unlock(&pool->mutex);
+
+    image_bind(&pool->functions);
+
+    int chunk;
+    while (pool_take(pool, worker->index, &chunk))
+      pool_chunk(pool, chunk, NULL, NULL);
+
+    pthread_mutex_lock(&pool->mutex);
+
+    if (--pool->busy == 0)
+      pthread_cond_signal(&pool->done);
+  }
+
+  pthread_mutex_unlock(&pool->mutex);
+
+  lt_close(lt);
+  return NULL;
+}
+
+static pool_t*
+pool_open ()
+{
+  pool_t *pool = calloc(1, sizeof(pool_t));
+  ensure(pool) errorf("%s calloc", __func__);
+
+  pool->workers = parallel_workers > 0
+    ? parallel_workers: sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (pool->workers < 1)
+    pool->workers = 1;
+
+  pool->worker = calloc(pool->workers, sizeof(worker_t));
+  ensure(pool->worker) errorf("%s calloc", __func__);
+
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->start, NULL);
+  pthread_cond_init(&pool->done, NULL);
+
+  if (pool->workers > 1)
+    image_capture(&pool->image);
+
+  for (int i = 0; i < pool->workers; i++)
+  {
+    worker_t *worker = &pool->worker[i];
+    worker->pool = pool;
+    worker->index = i;
+
+    if (i > 0)
+    {
+      ensure(!pthread_create(&worker->thread, NULL, pool_main, worker))
+        errorf("parallel: pthread_create failed");
+    }
+  }
+
+  return pool;
+}
+
+// run a job over the array, worker 0 on this interpreter's stack
+static pool_t*
+pool_run (int kind, vec_t *array, int64_t entry, vec_t *out)
+{
+  if (!parallel_pool)
+    parallel_pool = pool_open();
+
+  pool_t *pool = parallel_pool;
+
+  int items = array->count;
+  int chunks = pool->workers > 1 ? pool->workers * PARALLEL_GRAIN: 1;
+  if (chunks > items) chunks = items;
+
+  pool->kind = kind;
+  pool->entry = entry;
+  pool->items = items;
+  pool->grain = chunks ? (items + chunks - 1) / chunks: 0;
+  pool->chunks = pool->grain ? (items + pool->grain - 1) / pool->grain: 0;
+
+  if (pool->chunks > pool->result_limit)
+  {
+    pool->results = realloc(pool->results, sizeof(msg_t) * pool->chunks);
+    ensure(pool->results) errorf("%s realloc", __func__);
+    memset(&pool->results[pool->result_limit], 0, sizeof(msg_t) * (pool->chunks - pool->result_limit));
+    pool->result_limit = pool->chunks;
+  }
+
+  for (int i = 0; i < pool->workers; i++)
+  {
+    pool->worker[i].lo = (int64_t)pool->chunks * i / pool->workers;
+    pool->worker[i].hi = (int64_t)pool->chunks * (i+1) / pool->workers;
+  }
+
+  int helpers = pool->chunks > 1 ? pool->workers - 1: 0;
+
+  if (helpers)
+  {
+    if (items > pool->offset_limit)
+    {
+      pool->offset_limit = items;
+      pool->offsets = realloc(pool->offsets, sizeof(int) * items);
+      ensure(pool->offsets) errorf("%s realloc", __func__);
+    }
+
+    msg_clear(&pool->input);
+
+    for (int i = 0; i < items; i++)
+    {
+      pool->offsets[i] = pool->input.length;
+      msg_pack(&pool->input, vec_get(array, i)[0]);
+    }
+
+    image_functions(&pool->functions);
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->busy = helpers;
+    pool->job++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->mutex);
+  }
+
+  int chunk;
+  while (pool_take(pool, 0, &chunk))
+    pool_chunk(pool, chunk, array, out);
+
+  if (helpers)
+  {
+    pthread_mutex_lock(&pool->mutex);
+
+    while (pool->busy)
+      pthread_cond_wait(&pool->done, &pool->mutex);
+
+    pthread_mutex_unlock(&pool->mutex);
+  }
+
+  return pool;
+}
+
+// Fill out, which must be reachable from the stack, with the results of
+// calling the function at entry on each item of array, in order.
+void
+parallel_map (vec_t *array, int64_t entry, vec_t *out)
+{
+  for (int i = 0; i < array->count; i++)
+    vec_push(out)[0] = NULL;
+
+  pool_t *pool = pool_run(JOB_MAP, array, entry, out);
+
+  for (int chunk = 0; chunk < pool->chunks; chunk++)
+  {
+    msg_t *result = &pool->results[chunk];
+    int from = chunk * pool->grain;
+    int offset = 0;
+
+    for (int i = from; offset < result->length; i++)
+      vec_get(out, i)[0] = store(msg_unpack(result, &offset));
+  }
+}
+
+// Fold array with the function at entry, starting from *init if given.
+// Chunks are reduced separately and their results folded in order, so
+// the function must be associative. Returns the result.
+void*
+parallel_reduce (vec_t *array, int64_t entry, void **init)
+{
+  pool_t *pool = pool_run(JOB_REDUCE, array, entry, NULL);
+
+  op_mark();
+
+  int have = 0;
+
+  if (init)
+  {
+    push(copy(init[0]));
+    have = 1;
+  }
+
+  for (int chunk = 0; chunk < pool->chunks; chunk++)
+  {
+    int offset = 0;
+    push(msg_unpack(&pool->results[chunk], &offset));
+
+    if (have && !call(entry, 2))
+      push(NULL);
+
+    while (depth() > 1) op_drop();
+    have = 1;
+  }
+
+  void *value = have ? pop(): NULL;
+  op_unmark();
+  return value;
+}
+
+// stop the workers; their interpreters close on their own threads
+void
+parallel_close ()
+{
+  pool_t *pool = parallel_pool;
+  if (!pool) return;
+
+  pthread_mutex_lock(&pool->mutex);
+  pool->quit = 1;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->mutex);
+
+  for (int i = 1; i < pool->workers; i++)
+    pthread_join(pool->worker[i].thread, NULL);
+
+  for (int i = 0; i < pool->result_limit; i++)
+    msg_free(&pool->results[i]);
+
+  pthread_mutex_destroy(&pool->mutex);
+  pthread_cond_destroy(&pool->start);
+  pthread_cond_destroy(&pool->done);
+
+  image_free(&pool->image);
+  msg_free(&pool->functions);
+  msg_free(&pool->input);
+  free(pool->results);
+  free(pool->offsets);
+  free(pool->worker);
+  free(pool);
+
+  parallel_pool = NULL;
+}
@@ -29,6 +29,7 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
+#include <pthread.h>
 
 #include "arena.h"
 #include "op.h"
@@ -37,6 +38,11 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "map.h"
 #include "lt.h"
 #include "parse.h"
+#include "line.h"
+#include "collect.h"
+#include "io.h"
+#include "sched.h"
+#include "state.h"
 
 enum {
   EXPR_MULTI=1,
@@ -108,6 +114,21 @@ skip_gap (char *source)
   return offset;
 }
 
+static int
+is_source (char *start)
+{
+  return source_root && start >= source_root->str && start < source_root->str + source_root->length;
+}
+
+void*
+token (char *start, int length)
+{
+  if (is_source(start))
+    return slc_incref(slc_sub(source_root, start - source_root->str, length));
+
+  return substr(start, 0, length);
+}
+
 int
 peek (char *source, char *name)
 {
@@ -136,8 +157,8 @@ expr_keys_vals (expr_t *expr)
 void
 expr_free (expr_t *expr)
 {
-  if (expr->keys) { expr->keys->count = 0; discard(expr->keys); }
-  if (expr->vals) { expr->vals->count = 0; discard(expr->vals); }
+  if (expr->keys) { expr->keys->count = 0; vec_free(expr->keys); }
+  if (expr->vals) { expr->vals->count = 0; vec_free(expr->vals); }
   heap_free(expr);
 }
 
@@ -359,7 +380,7 @@ parse_item (char *source)
           errorf("expected variable: %s", &source[offset]);
 
         length = str_skip(&source[offset], isname);
-        vec_push(expr->keys)[0] = substr(&source[offset], 0, length);
+        vec_push(expr->keys)[0] = token(&source[offset], length);
         offset += length;
 
         offset += skip_gap(&source[offset]);
@@ -367,7 +388,7 @@ parse_item (char *source)
         {
           offset++;
           length = str_skip(&source[offset], isname);
-          vec_push(expr->keys)[0] = substr(&source[offset], 0, length);
+          vec_push(expr->keys)[0] = token(&source[offset], length);
           offset += length;
         }
 
@@ -394,7 +415,7 @@ parse_item (char *source)
         if (isnamefirst(source[offset]))
         {
           length = str_skip(&source[offset], isname);
-          expr->item = substr(&source[offset], 0, length);
+          expr->item = token(&source[offset], length);
           offset += length;
         }
 
@@ -430,7 +451,7 @@ parse_item (char *source)
 
             expr_t *param = expr_alloc();
             param->type = EXPR_VARIABLE;
-            param->item = substr(&source[offset], 0, length);
+            param->item = token(&source[offset], length);
             vec_push(expr->keys)[0] = param;
 
             offset += length;
@@ -510,7 +531,7 @@ parse_item (char *source)
       }
       else
       {
-        expr->item = substr(&source[offset], 0, length);
+        expr->item = token(&source[offset], length);
         offset += length;
       }
     }
@@ -683,6 +704,7 @@ parse (char *source, int results, int mode)
 
   expr_t *expr = expr_alloc();
   expr->type = EXPR_MULTI;
+  expr->source = &source[offset];
   expr->results = results;
   expr_keys_vals(expr);
 
@@ -804,9 +826,30 @@ parse (char *source, int results, int mode)
   return offset;
 }
 
+static void
+process_line (char *pos)
+{
+  char *start = source_root->str;
+
+  if (pos >= line_cursor)
+    for (char *p = line_cursor; (p = memchr(p, '\n', pos - p)); p++) line_number++;
+  else
+    for (char *p = pos; (p = memchr(p, '\n', line_cursor - p)); p++) line_number--;
+
+  line_cursor = pos;
+
+  char *bol = memrchr(start, '\n', pos - start);
+  line_mark(code_count, line_number, pos - (bol ? bol+1: start) + 1);
+}
+
 void
 process (expr_t *expr, int flags, int index)
 {
+  char *outer = line_source;
+
+  if (is_source(expr->source))
+    process_line(line_source = expr->source);
+
   int flag_assign = flags & PROCESS_ASSIGN ? 1:0;
   int flag_chain  = flags & PROCESS_CHAIN  ? 1:0;
   int flag_index  = flags & PROCESS_INDEX  ? 1:0;
@@ -837,7 +880,7 @@ process (expr_t *expr, int flags, int index)
     ensure(!expr->keys && !expr->vals);
 
     // if we're assigning with chained expressions, only OP_SET|OP_ASSIGN the last one
-    int assign = flag_assign && !expr->chain;
+    int assign = flag_assign && !expr->chain && !expr->index;
 
     // function or method call, optionally chained
     if (expr->call)
@@ -888,6 +931,9 @@ process (expr_t *expr, int flags, int index)
       char *left = str;
       char *right = str;
 
+      // literal segments share the bytes of the original string
+      slc_t *slc = slc_incref(slc_alloc(str));
+
       compile(OP_LIT)->ptr = strf("");
 
       while ((right = strchr(left, '$')) && right && *right)
@@ -911,7 +957,7 @@ process (expr_t *expr, int flags, int index)
           finish = &start[length];
         }
 
-        compile(OP_LIT)->ptr = substr(left, 0, right-left+(length ? 0:1));
+        compile(OP_LIT)->ptr = slc_incref(slc_sub(slc, left-str, right-left+(length ? 0:1)));
         compile(OP_CONCAT);
 
         left = finish;
@@ -927,10 +973,10 @@ process (expr_t *expr, int flags, int index)
         compile(OP_CONCAT);
       }
 
-      compile(OP_LIT)->ptr = substr(left, 0, strlen(left));
+      compile(OP_LIT)->ptr = slc_incref(slc_sub(slc, left-str, strlen(left)));
 
       compile(OP_CONCAT);
-      discard(expr->item);
+      discard(slc);
     }
     else
     {
@@ -938,7 +984,7 @@ process (expr_t *expr, int flags, int index)
     }
 
     if (flag_index)
-      compile(flag_assign ? OP_SET: OP_GET);
+      compile(flag_assign && !expr->index ? OP_SET: OP_GET);
   }
   else
   // inline opcode
@@ -950,9 +996,9 @@ process (expr_t *expr, int flags, int index)
     if (expr->opcode == OP_AND || expr->opcode == OP_OR)
     {
       process(vec_get(expr->vals, 0)[0], 0, 0);
-      code_t *jump = compile(expr->opcode);
+      int jump = compile(expr->opcode) - code;
       process(vec_get(expr->vals, 1)[0], 0, 0);
-      jump->offset = code_count;
+      code[jump].offset = code_count;
     }
     else
     {
@@ -961,6 +1007,10 @@ process (expr_t *expr, int flags, int index)
 
       compile(expr->opcode);
     }
+
+    // a computed key, as in a[#a]
+    if (flag_index)
+      compile(flag_assign && !expr->index ? OP_SET: OP_GET);
   }
   else
   // a built-in function-like keyword with arguments
@@ -987,7 +1037,7 @@ process (expr_t *expr, int flags, int index)
       process(expr->args, 0, 0);
 
     // if false, jump to else/end
-    code_t *jump = compile(OP_JFALSE);
+    int jump = compile(OP_JFALSE) - code;
     compile(OP_DROP);
 
     // success block
@@ -998,19 +1048,19 @@ process (expr_t *expr, int flags, int index)
     if (expr->keys && expr->keys->count)
     {
       // jump success path past failure block
-      code_t *jump2 = compile(OP_JMP);
-      jump->offset = code_count;
+      int jump2 = compile(OP_JMP) - code;
+      code[jump].offset = code_count;
       compile(OP_DROP);
 
       // failure block
       for (int i = 0; i < expr->keys->count; i++)
         process(vec_get(expr->keys, i)[0], 0, 0);
 
-      jump2->offset = code_count;
+      code[jump2].offset = code_count;
     }
     else
     {
-      jump->offset = code_count;
+      code[jump].offset = code_count;
     }
   }
   else
@@ -1020,7 +1070,7 @@ process (expr_t *expr, int flags, int index)
     ensure(expr->vals);
 
     compile(OP_MARK);
-    code_t *loop = compile(OP_LOOP);
+    int loop = compile(OP_LOOP) - code;
     int begin = code_count;
 
     // condition(s)
@@ -1028,7 +1078,7 @@ process (expr_t *expr, int flags, int index)
       process(expr->args, 0, 0);
 
     // if false, jump to end
-    code_t *jump = compile(OP_JFALSE);
+    int jump = compile(OP_JFALSE) - code;
     compile(OP_DROP);
 
     // do ... end
@@ -1037,8 +1087,8 @@ process (expr_t *expr, int flags, int index)
 
     // clean up
     compile(OP_JMP)->offset = begin;
-    jump->offset = code_count;
-    loop->offset = code_count;
+    code[jump].offset = code_count;
+    code[loop].offset = code_count;
     compile(OP_UNLOOP);
     compile(OP_LIMIT);
   }
@@ -1056,13 +1106,13 @@ process (expr_t *expr, int flags, int index)
     compile(OP_LIT)->ptr = to_int(0);
 
     compile(OP_MARK);
-    code_t *loop = compile(OP_LOOP);
+    int loop = compile(OP_LOOP) - code;
 
     int begin = code_count;
 
-    code_t *jump = compile(OP_FOR);
+    int jump = compile(OP_FOR) - code;
     // OP_FOR expects a vector with key[,val] variable names
-    jump->ptr = expr->keys;
+    code[jump].ptr = expr->keys;
     expr->keys = NULL;
 
     // do block
@@ -1071,8 +1121,8 @@ process (expr_t *expr, int flags, int index)
 
     // clean up
     compile(OP_JMP)->offset = begin;
-    jump->offset = code_count;
-    loop->offset = code_count;
+    code[jump].offset = code_count;
+    code[loop].offset = code_count;
     compile(OP_UNLOOP);
     compile(OP_LIMIT);
     compile(OP_LIMIT);
@@ -1084,7 +1134,7 @@ process (expr_t *expr, int flags, int index)
     ensure(!expr->args);
 
     compile(OP_MARK);
-    code_t *entry = compile(OP_LIT);
+    int entry = compile(OP_LIT) - code;
 
     if (expr->item)
     {
@@ -1093,8 +1143,8 @@ process (expr_t *expr, int flags, int index)
       name->offset = 0;
     }
 
-    code_t *jump = compile(OP_JMP);
-    entry->ptr = to_sub(code_count);
+    int jump = compile(OP_JMP) - code;
+    code[entry].ptr = to_sub(code_count);
 
     if (expr->keys) for (int i = 0; i < expr->keys->count; i++)
       process(vec_get(expr->keys, i)[0], PROCESS_ASSIGN, i);
@@ -1106,7 +1156,7 @@ process (expr_t *expr, int flags, int index)
     // will be dead code
     compile(OP_REPLY);
     compile(OP_RETURN);
-    jump->offset = code_count;
+    code[jump].offset = code_count;
 
     compile(OP_LIMIT)->offset = 1;
   }
@@ -1162,19 +1212,42 @@ process (expr_t *expr, int flags, int index)
   if (expr->index)
     process(expr->index, PROCESS_INDEX | (flag_assign ? PROCESS_ASSIGN: 0), 0);
 
+  if (line_source != outer)
+  {
+    line_source = outer;
+    if (outer) process_line(outer);
+  }
+
   expr_free(expr);
 }
 
 void
-source (char *s)
+source (slc_t *slc)
 {
   int offset = 0;
+  int base = code_count;
 
   int mark = depth();
 
+  // takes ownership of a reference to a root slice
+  source_root = slc;
+  char *s = slc->str;
+
+  line_source = NULL;
+  line_cursor = s;
+  line_number = 1;
+
   while (s[offset])
     offset += parse(&s[offset], RESULTS_DISCARD, PARSE_GREEDY);
 
   for (int i = mark; i < depth(); i++)
     process(item(i)[0], 0, 0);
+
+  // process() freed them
+  stack()->count -= depth() - mark;
+
+  code_borrow(base);
+
+  discard(source_root);
+  source_root = NULL;
 }
@@ -39,4 +39,4 @@ int isname (int);
 int islf (int);
 int skip (char*);
 int parse (char*, int, int);
-void source (char*);
+void source (slc_t*);
@@ -0,0 +1,542 @@
+/*
+Copyright (c) 2016 Sean Pringle sean.pringle@gmail.com
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "arena.h"
+#include "op.h"
+#include "str.h"
+#include "vec.h"
+#include "map.h"
+#include "lt.h"
+#include "profile.h"
+#include "line.h"
+#include "collect.h"
+#include "io.h"
+#include "sched.h"
+#include "state.h"
+
+uint64_t *op_counts;
+uint64_t *op_ticks;
+uint64_t *op_pairs;
+
+typedef struct {
+  const char *name;
+  arena_t *pool;
+} alloc_pool_t;
+
+// heap last: the others are carved out of it. The pools are the profiled
+// interpreter's, filled in by alloc_start()
+alloc_pool_t alloc_pools[] = {
+  { .name = "ints"  },
+  { .name = "dbls"  },
+  { .name = "strs"  },
+  { .name = "slcs"  },
+  { .name = "vecs"  },
+  { .name = "maps"  },
+  { .name = "nodes" },
+  { .name = "cors"  },
+  { .name = "subs"  },
+  { .name = "ios"   },
+  { .name = "chans" },
+  { .name = "heap"  },
+};
+
+#define ALLOC_POOLS (sizeof(alloc_pools) / sizeof(alloc_pool_t))
+
+// per pool, per ip; the extra ip slot is for allocations outside bytecode
+uint64_t *alloc_site_counts;
+uint64_t *alloc_site_bytes;
+int alloc_site_width;
+
+uint64_t alloc_counts[ALLOC_POOLS];
+uint64_t alloc_frees[ALLOC_POOLS];
+int64_t alloc_initial[ALLOC_POOLS];
+int64_t alloc_live[ALLOC_POOLS];
+int64_t alloc_peak[ALLOC_POOLS];
+
+// cycles where the TSC is available, otherwise nanoseconds
+static inline uint64_t
+ticks ()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+#define SAMPLE_HZ 1000
+#define SAMPLE_DEPTH 256
+
+typedef struct {
+  int entry;
+  int end;
+  char *name;
+} prof_func_t;
+
+typedef struct {
+  int *frames;
+  int depth;
+  int next;
+  uint64_t count;
+} prof_stack_t;
+
+int profile_flags;
+int profile_base;
+
+prof_func_t *prof_funcs;
+int prof_func_count;
+
+prof_stack_t *prof_stacks;
+int prof_stack_count;
+int prof_stack_limit;
+int prof_buckets[4096];
+
+volatile sig_atomic_t sample_pending;
+
+static void
+on_sigprof (int sig)
+{
+  sample_pending = 1;
+}
+
+// "name:line" where the function is defined, when the line is known
+static char*
+prof_name (void *ptr, int ip)
+{
+  int line = 0;
+  line_find(ip, &line, NULL);
+
+  const char *str = ptr ? get_str(ptr): "function";
+  int length = ptr ? count(ptr): strlen(str);
+
+  char *name = NULL;
+  int rc = line ? asprintf(&name, "%.*s:%d", length, str, line)
+    : asprintf(&name, "%.*s", length, str);
+
+  ensure(rc >= 0) errorf("%s asprintf", __func__);
+  return name;
+}
+
+// Functions compile to OP_LIT sub(entry), optional OP_ASSIGN_LIT name, and
+// an OP_JMP over the body, so each body is the range [entry, jmp offset).
+static void
+prof_functions ()
+{
+  prof_funcs = calloc(code_count+1, sizeof(prof_func_t));
+  ensure(prof_funcs) errorf("%s calloc", __func__);
+
+  prof_funcs[prof_func_count++] = (prof_func_t){ .entry = 0, .end = code_count, .name = "main" };
+
+  for (int i = 0; i < code_count; i++)
+  {
+    code_t *c = &code[i];
+    if (c->op != OP_LIT || !is_sub(c->ptr)) continue;
+
+    int entry = get_sub(c->ptr);
+    if (entry < 1 || entry > code_count || code[entry-1].op != OP_JMP) continue;
+
+    prof_func_t *func = &prof_funcs[prof_func_count++];
+    func->entry = entry;
+    func->end = code[entry-1].offset;
+    func->name = prof_name(code[i+1].op == OP_ASSIGN_LIT && is_text(code[i+1].ptr)
+      ? code[i+1].ptr: NULL, i);
+  }
+}
+
+// innermost function containing ip; builtin stubs sit below profile_base
+// as [op, OP_RETURN] pairs
+static int
+prof_function (int ip)
+{
+  int best = 0;
+
+  for (int i = 1; i < prof_func_count; i++)
+  {
+    prof_func_t *func = &prof_funcs[i];
+
+    if (ip >= func->entry && ip < func->end && func->end - func->entry < prof_funcs[best].end - prof_funcs[best].entry)
+      best = i;
+  }
+
+  if (!best && ip < profile_base)
+    return -code[ip - (ip % 2)].op;
+
+  return best;
+}
+
+static const char*
+prof_frame_name (int frame)
+{
+  return frame < 0 ? funcs[-frame].name: prof_funcs[frame].name;
+}
+
+static void
+prof_sample ()
+{
+  int frames[SAMPLE_DEPTH];
+  int depth = 0;
+
+  for (int r = 0; r < routine_count && depth < SAMPLE_DEPTH; r++)
+  {
+    cor_t *cor = routines[r];
+
+    // calls holds (loops, marks, return ip) triples
+    for (int i = 2; i < cor->calls.count && depth < SAMPLE_DEPTH; i += 3)
+      frames[depth++] = prof_function(cor->calls.items[i]-1);
+
+    if (depth < SAMPLE_DEPTH)
+      frames[depth++] = prof_function(cor->ip);
+  }
+
+  uint32_t hash = 5381;
+  for (int i = 0; i < depth; i++)
+    hash = hash * 33 + frames[i];
+
+  int *bucket = &prof_buckets[hash % (sizeof(prof_buckets) / sizeof(int))];
+
+  for (int i = *bucket; i; i = prof_stacks[i].next)
+  {
+    prof_stack_t *stack = &prof_stacks[i];
+
+    if (stack->depth == depth && !memcmp(stack->frames, frames, sizeof(int) * depth))
+    {
+      stack->count++;
+      return;
+    }
+  }
+
+  if (prof_stack_count == prof_stack_limit)
+  {
+    prof_stack_limit += 1024;
+    prof_stacks = realloc(prof_stacks, sizeof(prof_stack_t) * prof_stack_limit);
+    ensure(prof_stacks) errorf("%s realloc", __func__);
+  }
+
+  // index 0 terminates bucket chains
+  if (!prof_stack_count)
+    prof_stack_count++;
+
+  prof_stack_t *stack = &prof_stacks[prof_stack_count];
+  stack->frames = malloc(sizeof(int) * depth);
+  ensure(stack->frames) errorf("%s malloc", __func__);
+  memcpy(stack->frames, frames, sizeof(int) * depth);
+  stack->depth = depth;
+  stack->count = 1;
+  stack->next = *bucket;
+  *bucket = prof_stack_count++;
+}
+
+// arena observer: pages are charged to the instruction being executed
+static void
+alloc_observe (void *pool, void *ptr, int bytes)
+{
+  int p = 0;
+  while (p < ALLOC_POOLS && alloc_pools[p].pool != pool) p++;
+  if (p == ALLOC_POOLS) return;
+
+  if (bytes > 0)
+  {
+    int ip = routine_count ? routine()->ip - 1: -1;
+
+    // builtin stubs charge the script instruction that called them
+    if (ip >= 0 && ip < profile_base && routine()->calls.count >= 3)
+      ip = routine()->calls.items[routine()->calls.count-1] - 1;
+
+    if (ip < 0 || ip >= code_count) ip = code_count;
+
+    alloc_site_counts[p * alloc_site_width + ip]++;
+    alloc_site_bytes[p * alloc_site_width + ip] += bytes;
+    alloc_counts[p]++;
+  }
+  else
+  {
+    alloc_frees[p]++;
+  }
+
+  alloc_live[p] += bytes;
+
+  if (alloc_live[p] > alloc_peak[p])
+    alloc_peak[p] = alloc_live[p];
+}
+
+static void
+alloc_start ()
+{
+  alloc_site_width = code_count+1;
+  alloc_site_counts = calloc(ALLOC_POOLS * alloc_site_width, sizeof(uint64_t));
+  alloc_site_bytes = calloc(ALLOC_POOLS * alloc_site_width, sizeof(uint64_t));
+
+  ensure(alloc_site_counts && alloc_site_bytes)
+    errorf("%s calloc", __func__);
+
+  // other interpreters' arenas never match, so their threads go uncounted
+  arena_t *pools[] = { ints, dbls, strs, slcs, vecs, maps, nodes, cors, subs, ios, chans, heap };
+
+  // pages already in use are reported as initial bytes, and count towards
+  // live and peak so that live = initial + allocated - freed
+  for (int p = 0; p < ALLOC_POOLS; p++)
+  {
+    arena_t *arena = alloc_pools[p].pool = pools[p];
+    alloc_initial[p] = arena ? (int64_t)arena_usage(arena) * arena->page_size: 0;
+    alloc_live[p] = alloc_initial[p];
+    alloc_peak[p] = alloc_initial[p];
+  }
+
+  arena_observer = alloc_observe;
+}
+
+// Same dispatch as run(), with profiling hooks. Kept separate so the
+// normal loop pays nothing when profiling is off. SIGPROF only raises a
+// flag; the stack is walked between instructions when VM state is
+// consistent.
+void
+profile_run (int flags)
+{
+  profile_flags = flags;
+  profile_base = routine()->ip;
+
+  if (flags & PROFILE_OPS)
+  {
+    op_counts = calloc(func_count, sizeof(uint64_t));
+    op_ticks = calloc(func_count, sizeof(uint64_t));
+    op_pairs = calloc(func_count * func_count, sizeof(uint64_t));
+
+    ensure(op_counts && op_ticks && op_pairs)
+      errorf("%s calloc", __func__);
+  }
+
+  if (flags & PROFILE_SAMPLE)
+  {
+    prof_functions();
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigprof;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, NULL);
+
+    struct itimerval timer = {
+      .it_interval = { .tv_sec = 0, .tv_usec = 1000000 / SAMPLE_HZ },
+      .it_value = { .tv_sec = 0, .tv_usec = 1000000 / SAMPLE_HZ },
+    };
+    setitimer(ITIMER_PROF, &timer, NULL);
+  }
+
+  if (flags & PROFILE_ALLOC)
+    alloc_start();
+
+  int prev = 0;
+
+  while (code[routine()->ip].op)
+  {
+    if (sample_pending)
+    {
+      sample_pending = 0;
+      prof_sample();
+    }
+
+    int op = code[routine()->ip++].op;
+
+    if (flags & PROFILE_OPS)
+    {
+      uint64_t start = ticks();
+      if (op != OP_NOP) funcs[op].func();
+      op_ticks[op] += ticks() - start;
+
+      op_counts[op]++;
+      op_pairs[prev * func_count + op]++;
+      prev = op;
+    }
+    else
+    {
+      if (op != OP_NOP) funcs[op].func();
+    }
+  }
+
+  if (flags & PROFILE_SAMPLE)
+  {
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+  }
+
+  arena_observer = NULL;
+}
+
+// folded stacks, one "a;b;c count" line each, for flamegraph tools
+static void
+profile_sample_report ()
+{
+  for (int i = 1; i < prof_stack_count; i++)
+  {
+    prof_stack_t *stack = &prof_stacks[i];
+
+    for (int j = 0; j < stack->depth; j++)
+      fprintf(stderr, "%s%s", j ? ";": "", prof_frame_name(stack->frames[j]));
+
+    fprintf(stderr, " %lu\n", stack->count);
+  }
+  fflush(stderr);
+}
+
+static uint64_t *sort_by;
+
+static int
+sort_desc (const void *a, const void *b)
+{
+  uint64_t x = sort_by[*(int*)a];
+  uint64_t y = sort_by[*(int*)b];
+  return x < y ? 1: (x > y ? -1: 0);
+}
+
+static void
+profile_ops_report ()
+{
+
+  uint64_t total_ticks = 0;
+  uint64_t total_count = 0;
+
+  int *order = calloc(func_count * func_count, sizeof(int));
+  ensure(order) errorf("%s calloc", __func__);
+
+  for (int op = 0; op < func_count; op++)
+  {
+    total_ticks += op_ticks[op];
+    total_count += op_counts[op];
+    order[op] = op;
+  }
+
+  sort_by = op_ticks;
+  qsort(order, func_count, sizeof(int), sort_desc);
+
+  errorf("%-12s %12s %14s %8s %6s", "op", "count", "ticks", "ticks/op", "%");
+
+  for (int i = 0; i < func_count; i++)
+  {
+    int op = order[i];
+    if (!op_counts[op]) break;
+
+    errorf("%-12s %12lu %14lu %8lu %5.1f%%", funcs[op].name, op_counts[op], op_ticks[op],
+      op_ticks[op] / op_counts[op], total_ticks ? op_ticks[op] * 100.0 / total_ticks: 0.0);
+  }
+
+  errorf("%-12s %12lu %14lu", "total", total_count, total_ticks);
+
+  for (int i = 0; i < func_count * func_count; i++)
+    order[i] = i;
+
+  sort_by = op_pairs;
+  qsort(order, func_count * func_count, sizeof(int), sort_desc);
+
+  errorf("\n%-25s %12s %6s", "pair", "count", "%");
+
+  for (int i = 0; i < 32 && i < func_count * func_count; i++)
+  {
+    int pair = order[i];
+    if (!op_pairs[pair]) break;
+
+    int a = pair / func_count, b = pair % func_count;
+    errorf("%-12s %-12s %12lu %5.1f%%", a ? funcs[a].name: "-", funcs[b].name, op_pairs[pair],
+      total_count ? op_pairs[pair] * 100.0 / total_count: 0.0);
+  }
+
+  free(order);
+}
+
+static void
+profile_alloc_report ()
+{
+  errorf("%-6s %14s %12s %12s %14s %14s", "pool", "initial bytes", "allocs", "frees", "peak bytes", "live bytes");
+
+  for (int p = 0; p < ALLOC_POOLS; p++)
+  {
+    if (!alloc_counts[p] && !alloc_peak[p]) continue;
+
+    errorf("%-6s %14ld %12lu %12lu %14ld %14ld", alloc_pools[p].name, alloc_initial[p],
+      alloc_counts[p], alloc_frees[p], alloc_peak[p], alloc_live[p]);
+  }
+
+  int sites = ALLOC_POOLS * alloc_site_width;
+
+  int *order = calloc(sites, sizeof(int));
+  ensure(order) errorf("%s calloc", __func__);
+
+  for (int i = 0; i < sites; i++)
+    order[i] = i;
+
+  sort_by = alloc_site_bytes;
+  qsort(order, sites, sizeof(int), sort_desc);
+
+  errorf("\n%-6s %6s %-8s %-12s %12s %14s", "pool", "ip", "line", "op", "allocs", "bytes");
+
+  for (int i = 0; i < 32 && i < sites; i++)
+  {
+    int site = order[i];
+    if (!alloc_site_bytes[site]) break;
+
+    int p = site / alloc_site_width, ip = site % alloc_site_width;
+
+    char pos[32] = "-";
+    int line, column;
+
+    if (ip < code_count && line_find(ip, &line, &column))
+      snprintf(pos, sizeof(pos), "%d:%d", line, column);
+
+    errorf("%-6s %6d %-8s %-12s %12lu %14lu", alloc_pools[p].name, ip, pos,
+      ip < code_count ? funcs[code[ip].op].name: "-", alloc_site_counts[site], alloc_site_bytes[site]);
+  }
+
+  free(order);
+}
+
+void
+profile_report ()
+{
+  if (profile_flags & PROFILE_OPS)
+    profile_ops_report();
+
+  if (profile_flags & PROFILE_SAMPLE)
+    profile_sample_report();
+
+  if (profile_flags & PROFILE_ALLOC)
+    profile_alloc_report();
+}
@@ -0,0 +1,234 @@
+/*
+Copyright (c) 2016 Sean Pringle sean.pringle@gmail.com
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "arena.h"
+#include "op.h"
+#include "str.h"
+#include "vec.h"
+#include "map.h"
+#include "lt.h"
+#include "io.h"
+#include "sched.h"
+#include "ring.h"
+#include "collect.h"
+#include "line.h"
+#include "state.h"
+
+// map the rings, or turn the ring off for good if the kernel says no;
+// reads at the current file position need IORING_FEAT_RW_CUR_POS
+static int
+ring_open ()
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+
+  int fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+
+  if (fd < 0 || !(p.features & IORING_FEAT_RW_CUR_POS) || !(p.features & IORING_FEAT_SINGLE_MMAP))
+  {
+    if (fd >= 0) close(fd);
+    ring_enabled = 0;
+    return 0;
+  }
+
+  size_t sq_bytes = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cq_bytes = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  size_t bytes = sq_bytes > cq_bytes ? sq_bytes: cq_bytes;
+
+  char *rings = mmap(NULL, bytes, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  ring_sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+
+  if (rings == MAP_FAILED || ring_sqes == MAP_FAILED)
+  {
+    if (rings != MAP_FAILED) munmap(rings, bytes);
+    if (ring_sqes != MAP_FAILED) munmap(ring_sqes, p.sq_entries * sizeof(struct io_uring_sqe));
+    ring_sqes = NULL;
+    close(fd);
+    ring_enabled = 0;
+    return 0;
+  }
+
+  ring_map = rings;
+  ring_map_bytes = bytes;
+  ring_sqes_bytes = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  ring_sq_tail = (unsigned*)(rings + p.sq_off.tail);
+  ring_sq_mask = (unsigned*)(rings + p.sq_off.ring_mask);
+  ring_sq_array = (unsigned*)(rings + p.sq_off.array);
+  ring_cq_head = (unsigned*)(rings + p.cq_off.head);
+  ring_cq_tail = (unsigned*)(rings + p.cq_off.tail);
+  ring_cq_mask = (unsigned*)(rings + p.cq_off.ring_mask);
+  ring_cqes = (struct io_uring_cqe*)(rings + p.cq_off.cqes);
+  ring_cq_entries = p.cq_entries;
+
+  ring_fd = fd;
+  return 1;
+}
+
+// Queue a read for the running task into buf at the file's position,
+// holding a reference to io until the completion is reaped. Returns -1
+// when the ring is off or full; the caller reads directly.
+int
+ring_read (io_t *io, char *buf, int length)
+{
+  if (!ring_enabled || (ring_fd < 0 && !ring_open()))
+    return -1;
+
+  // every read in flight must have room in the completion ring; what the
+  // kernel has finished already makes some
+  if (ring_queued + ring_flight == ring_cq_entries)
+  {
+    ring_submit();
+    ring_reap();
+  }
+
+  if (ring_queued + ring_flight == ring_cq_entries)
+    return -1;
+
+  if (ring_queued == RING_ENTRIES)
+    ring_submit();
+
+  unsigned tail = *ring_sq_tail;
+  unsigned index = tail & *ring_sq_mask;
+  struct io_uring_sqe *sqe = &ring_sqes[index];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = io->fd;
+  sqe->off = (uint64_t)-1;
+  sqe->addr = (uint64_t)(uintptr_t)buf;
+  sqe->len = length;
+  sqe->user_data = (uint64_t)(uintptr_t)io_incref(io);
+
+  ring_sq_array[index] = index;
+  __atomic_store_n(ring_sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  io->flags |= IO_QUEUED;
+  ring_queued++;
+  ring_reads++;
+  return 0;
+}
+
+int
+ring_pending ()
+{
+  return ring_queued + ring_flight;
+}
+
+// hand everything queued to the kernel in one call
+void
+ring_submit ()
+{
+  while (ring_queued)
+  {
+    int done = syscall(__NR_io_uring_enter, ring_fd, ring_queued, 0, 0, NULL, 0);
+
+    if (done < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY))
+      continue;
+
+    ensure(done > 0)
+      errorf("io_uring_enter: %s", strerror(errno));
+
+    ring_queued -= done;
+    ring_flight += done;
+    ring_submits++;
+  }
+}
+
+// Completions release the io each read pinned, so neither it nor its
+// buffer can go while the kernel may still write there. A waiter that
+// died meanwhile is still woken: sched_next() drops its last reference.
+static int
+ring_complete (int wake)
+{
+  unsigned head = *ring_cq_head;
+  unsigned tail = __atomic_load_n(ring_cq_tail, __ATOMIC_ACQUIRE);
+  int reaped = 0;
+
+  for (; head != tail; head++, reaped++)
+  {
+    struct io_uring_cqe *cqe = &ring_cqes[head & *ring_cq_mask];
+    io_t *io = (io_t*)(uintptr_t)cqe->user_data;
+
+    io->result = cqe->res;
+    io->flags = (io->flags & ~IO_QUEUED) | IO_DONE;
+
+    if (wake && io->waiter)
+      sched_wake(io->waiter);
+
+    io->waiter = NULL;
+    io_decref(io);
+  }
+
+  __atomic_store_n(ring_cq_head, head, __ATOMIC_RELEASE);
+  ring_flight -= reaped;
+  return reaped;
+}
+
+// wake the tasks whose reads have finished; returns how many
+int
+ring_reap ()
+{
+  return ring_complete(1);
+}
+
+// Unmap the rings of an interpreter that is closing. Reads still in
+// flight belong to tasks that will never run again, but the kernel may
+// yet write to their buffers, so wait them out first.
+void
+ring_close ()
+{
+  if (ring_fd < 0)
+    return;
+
+  ring_submit();
+
+  while (ring_flight)
+  {
+    int done = syscall(__NR_io_uring_enter, ring_fd, 0, ring_flight, IORING_ENTER_GETEVENTS, NULL, 0);
+
+    ensure(done >= 0 || errno == EINTR || errno == EAGAIN || errno == EBUSY)
+      errorf("io_uring_enter: %s", strerror(errno));
+
+    ring_complete(0);
+  }
+
+  munmap(ring_map, ring_map_bytes);
+  munmap(ring_sqes, ring_sqes_bytes);
+  close(ring_fd);
+  ring_fd = -1;
+}
@@ -0,0 +1,335 @@
+/*
+Copyright (c) 2016 Sean Pringle sean.pringle@gmail.com
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+
+#include "arena.h"
+#include "op.h"
+#include "str.h"
+#include "vec.h"
+#include "map.h"
+#include "lt.h"
+#include "collect.h"
+#include "io.h"
+#include "sched.h"
+#include "ring.h"
+#include "line.h"
+#include "state.h"
+
+#define SCHED_EVENTS 64
+
+// The scheduler holds a counted reference to every task until it dies.
+// Runnable tasks wait in a ring, parked ones in waits[] by descriptor.
+
+static void
+enqueue (cor_t *cor)
+{
+  if (sched_queued == sched_limit)
+  {
+    int limit = sched_limit ? sched_limit * 2: 32;
+    cor_t **queue = heap_alloc(sizeof(cor_t*) * limit);
+
+    for (int i = 0; i < sched_queued; i++)
+      queue[i] = sched_queue[(sched_head + i) % sched_limit];
+
+    if (sched_queue) heap_free(sched_queue);
+    sched_queue = queue;
+    sched_limit = limit;
+    sched_head = 0;
+  }
+  sched_queue[(sched_head + sched_queued++) % sched_limit] = cor;
+}
+
+static cor_t*
+dequeue ()
+{
+  cor_t *cor = sched_queue[sched_head];
+  sched_head = (sched_head + 1) % sched_limit;
+  sched_queued--;
+  return cor;
+}
+
+void
+sched_spawn (cor_t *cor)
+{
+  enqueue(store(cor));
+  sched_count++;
+}
+
+int
+sched_task ()
+{
+  return sched_current && routine() == sched_current;
+}
+
+int
+sched_tasks ()
+{
+  return sched_count;
+}
+
+int
+sched_waiting ()
+{
+  return sched_parked;
+}
+
+// register what the tasks parked on fd wait for
+static void
+watch (int fd)
+{
+  wait_t *wait = &sched_waits[fd];
+  int events = (wait->reader ? EPOLLIN: 0) | (wait->writer ? EPOLLOUT: 0);
+
+  if (events == wait->events)
+    return;
+
+  struct epoll_event ev = { .events = events, .data = { .fd = fd } };
+  int op = !events ? EPOLL_CTL_DEL: !wait->events ? EPOLL_CTL_ADD: EPOLL_CTL_MOD;
+
+  ensure(epoll_ctl(sched_epoll, op, fd, &ev) == 0)
+    errorf("epoll_ctl %d: %s", fd, strerror(errno));
+
+  wait->events = events;
+}
+
+// fd is about to be closed
+void
+sched_close (int fd)
+{
+  if (fd < sched_wait_limit && sched_waits[fd].events)
+  {
+    epoll_ctl(sched_epoll, EPOLL_CTL_DEL, fd, NULL);
+    sched_waits[fd].events = 0;
+  }
+}
+
+static void
+poller ()
+{
+  if (sched_epoll >= 0)
+    return;
+
+  sched_epoll = epoll_create1(EPOLL_CLOEXEC);
+
+  ensure(sched_epoll >= 0)
+    errorf("epoll_create1: %s", strerror(errno));
+}
+
+// Take the running task off the routine stack until sched_wake(). The op
+// that suspends it is rewound, so it runs again when the task resumes.
+cor_t*
+sched_suspend ()
+{
+  cor_t *cor = routine_pop();
+  cor->ip--;
+  cor->state = COR_SUSPENDED;
+
+  sched_parked++;
+  sched_current = NULL;
+  return cor;
+}
+
+void
+sched_wake (cor_t *cor)
+{
+  enqueue(cor);
+  sched_parked--;
+}
+
+// suspend the running task until fd can be read, or written
+void
+sched_park (int fd, int writing)
+{
+  poller();
+
+  if (fd >= sched_wait_limit)
+  {
+    int limit = sched_wait_limit ? sched_wait_limit: 64;
+    while (limit <= fd) limit *= 2;
+
+    sched_waits = sched_waits
+      ? heap_realloc(sched_waits, sizeof(wait_t) * limit)
+      : heap_alloc(sizeof(wait_t) * limit);
+
+    memset(&sched_waits[sched_wait_limit], 0, sizeof(wait_t) * (limit - sched_wait_limit));
+    sched_wait_limit = limit;
+  }
+
+  wait_t *wait = &sched_waits[fd];
+  cor_t **slot = writing ? &wait->writer: &wait->reader;
+
+  ensure(!*slot)
+    errorf("fd %d: another task is already waiting to %s", fd, writing ? "write": "read");
+
+  *slot = sched_suspend();
+  watch(fd);
+}
+
+// make tasks runnable whose descriptors are ready, waiting if none are
+static void
+wake (int timeout)
+{
+  struct epoll_event events[SCHED_EVENTS];
+
+  poller();
+
+  // file reads queued by tasks this pass go to the kernel together, and
+  // the completion ring wakes epoll like any descriptor
+  if (ring_pending())
+  {
+    ring_submit();
+
+    if (!sched_ring)
+    {
+      struct epoll_event ev = { .events = EPOLLIN, .data = { .fd = ring_fd } };
+
+      ensure(epoll_ctl(sched_epoll, EPOLL_CTL_ADD, ring_fd, &ev) == 0)
+        errorf("epoll_ctl ring: %s", strerror(errno));
+
+      sched_ring = 1;
+    }
+
+    if (ring_reap())
+      timeout = 0;
+  }
+
+  int ready = epoll_wait(sched_epoll, events, SCHED_EVENTS, timeout);
+
+  ensure(ready >= 0 || errno == EINTR)
+    errorf("epoll_wait: %s", strerror(errno));
+
+  for (int i = 0; i < ready; i++)
+  {
+    int fd = events[i].data.fd;
+
+    if (sched_ring && fd == ring_fd)
+    {
+      ring_reap();
+      continue;
+    }
+
+    wait_t *wait = &sched_waits[fd];
+    int ev = events[i].events;
+
+    int idle = ev & ~((wait->reader ? EPOLLIN|EPOLLHUP|EPOLLERR: 0) | (wait->writer ? EPOLLOUT|EPOLLHUP|EPOLLERR: 0));
+
+    if (wait->reader && (ev & (EPOLLIN|EPOLLHUP|EPOLLERR)))
+    {
+      sched_wake(wait->reader);
+      wait->reader = NULL;
+    }
+
+    if (wait->writer && (ev & (EPOLLOUT|EPOLLHUP|EPOLLERR)))
+    {
+      sched_wake(wait->writer);
+      wait->writer = NULL;
+    }
+
+    // registrations outlive the wait, saving two syscalls each time a
+    // task parks on the same descriptor; they go once they fire idle
+    if (idle)
+      watch(fd);
+  }
+}
+
+// Settle the task that just gave control back to io.run() and choose the
+// next one to resume, or NULL once every task has finished.
+cor_t*
+sched_next ()
+{
+  if (!sched_home)
+    sched_home = routine();
+
+  ensure(routine() == sched_home)
+    errorf("io.run() is already running");
+
+  cor_t *cor = sched_current;
+  sched_current = NULL;
+
+  if (cor && cor->state == COR_DEAD)
+  {
+    discard(unstore(cor));
+    sched_count--;
+  }
+  else
+  if (cor)
+  {
+    enqueue(cor);
+  }
+
+  for (;;)
+  {
+    // look for ready descriptors once per pass over the runnable tasks,
+    // or wait for one when nothing else can run
+    if (sched_parked && (!sched_queued || --sched_turns <= 0))
+    {
+      wake(sched_queued ? 0: -1);
+      sched_turns = sched_queued;
+    }
+
+    // a signal can end the wait with nothing woken; parked tasks are
+    // still owed a turn, so only stop once none remain
+    if (!sched_queued && !sched_parked)
+      break;
+
+    if (!sched_queued)
+      continue;
+
+    cor = dequeue();
+
+    // finished after someone else resumed it
+    if (cor->state == COR_DEAD)
+    {
+      discard(unstore(cor));
+      sched_count--;
+      continue;
+    }
+
+    sched_current = cor;
+    return cor;
+  }
+
+  sched_home = NULL;
+  return NULL;
+}
+
+// release the epoll descriptor of an interpreter that is closing
+void
+sched_shutdown ()
+{
+  if (sched_epoll >= 0)
+    close(sched_epoll);
+
+  sched_epoll = -1;
+}
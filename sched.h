@@ -0,0 +1,45 @@
+/*
+Copyright (c) 2016 Sean Pringle sean.pringle@gmail.com
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// A spawned task is a coroutine the scheduler resumes from io.run(). When
+// a task's read or write would block it parks on the descriptor instead,
+// and the op that parked it runs again once epoll reports it ready. Only
+// the task itself parks; coroutines it resumes block as before.
+
+// tasks parked on one descriptor, and the events registered for them
+typedef struct {
+  cor_t *reader;
+  cor_t *writer;
+  int events;
+} wait_t;
+
+void sched_spawn (cor_t*);
+void sched_park (int, int);
+cor_t* sched_suspend ();
+void sched_wake (cor_t*);
+void sched_close (int);
+cor_t* sched_next ();
+int sched_task ();
+int sched_tasks ();
+int sched_waiting ();
+void sched_shutdown ();
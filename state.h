@@ -0,0 +1,362 @@
+/*
+Copyright (c) 2016 Sean Pringle sean.pringle@gmail.com
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+// Everything one interpreter owns. Each thread runs at most one
+// interpreter at a time, found through lt; the names below stand for its
+// fields, so the code reads as it did when they were globals. Include
+// this last: it needs the types from every other header.
+
+struct lt_state {
+  // lt.c
+  int lt_flags;
+  slc_t **script_chunks;
+  int script_chunk_count;
+  int script_chunk_limit;
+
+  arena_t *heap;
+  arena_t *ints;
+  arena_t *dbls;
+  arena_t *strs;
+  arena_t *vecs;
+  arena_t *maps;
+  arena_t *cors;
+  arena_t *subs;
+  arena_t *slcs;
+  arena_t *ios;
+  arena_t *chans;
+  arena_t *nodes;
+
+  int int_count;
+  int int_created;
+  int int_destroyed;
+  int dbl_count;
+  int dbl_created;
+  int dbl_destroyed;
+  int str_count;
+  int str_created;
+  int str_destroyed;
+  int vec_count;
+  int vec_created;
+  int vec_destroyed;
+  int map_count;
+  int map_created;
+  int map_destroyed;
+  int cor_count;
+  int cor_created;
+  int cor_destroyed;
+  int sub_count;
+  int sub_created;
+  int sub_destroyed;
+  int slc_count;
+  int slc_created;
+  int slc_destroyed;
+  int io_count;
+  int io_created;
+  int io_destroyed;
+
+  int heap_mem;
+  int ints_mem;
+  int dbls_mem;
+  int strs_mem;
+  int vecs_mem;
+  int maps_mem;
+  int cors_mem;
+  int subs_mem;
+  int slcs_mem;
+  int ios_mem;
+  int chans_mem;
+
+  map_t *scope_core;
+  map_t *scope_global;
+  map_t *super_str;
+  map_t *super_vec;
+  map_t *super_map;
+
+  // the running coroutine is routines[routine_count-1], kept on hand
+  cor_t **routines;
+  cor_t *routine_top;
+  int routine_count;
+  int routine_limit;
+
+  code_t *code;
+  int code_count;
+  int code_limit;
+
+  FILE *stream_output;
+  io_t *stream_input;
+  int output_tty;
+  int output_length;
+  char output_buffer[OUTPUT_BUFFER];
+
+  cor_t cor_pool[COR_POOL];
+  int cor_pooled;
+
+  // collect.c
+  int collect_pending;
+  int collect_allocs;
+  int collect_urgent;
+  int collect_urges;
+  int collect_urge_wait;
+  int collect_threshold;
+  int collect_runs;
+  int collect_freed;
+  int collect_slices;
+  int collect_reconciles;
+  int collect_reclaimed;
+  int64_t collect_pause_total;
+  int64_t collect_pause_max;
+  int64_t collect_pause_last;
+
+  int collect_phase;
+  int collect_cursor;
+  int collect_kept;
+
+  plist_t collect_buffer;
+  plist_t collect_cycle;
+  plist_t collect_zct;
+  int collect_zct_limit;
+  int collect_zct_floor;
+  plist_t collect_traced;
+  plist_t collect_work;
+  plist_t collect_cands;
+
+  // sched.c
+  cor_t **sched_queue;
+  int sched_head;
+  int sched_queued;
+  int sched_limit;
+  wait_t *sched_waits;
+  int sched_wait_limit;
+  int sched_parked;
+  int sched_epoll;
+  int sched_ring;
+  int sched_count;
+  int sched_turns;
+  cor_t *sched_home;
+  cor_t *sched_current;
+
+  // ring.c
+  int ring_enabled;
+  int ring_fd;
+  int ring_reads;
+  int ring_submits;
+  int ring_queued;
+  int ring_flight;
+  char *ring_map;
+  size_t ring_map_bytes;
+  unsigned *ring_sq_tail;
+  unsigned *ring_sq_mask;
+  unsigned *ring_sq_array;
+  struct io_uring_sqe *ring_sqes;
+  size_t ring_sqes_bytes;
+  unsigned *ring_cq_head;
+  unsigned *ring_cq_tail;
+  unsigned *ring_cq_mask;
+  struct io_uring_cqe *ring_cqes;
+  unsigned ring_cq_entries;
+
+  // line.c
+  unsigned char *line_table;
+  int line_bytes;
+  int line_limit;
+  int line_entries;
+  line_state_t *line_points;
+  int line_point_count;
+  int line_point_limit;
+  line_state_t line_last;
+  line_state_t line_prev;
+
+  // parse.c
+  slc_t *source_root;
+  char *line_source;
+  char *line_cursor;
+  int line_number;
+
+  // parallel.c
+  struct pool *parallel_pool;
+  int parallel_workers;
+};
+
+// local-exec: lt is reached with one %fs-relative load, as plain globals
+// were; the interpreter must be linked into the executable
+extern __thread lt_state *lt __attribute__((tls_model("local-exec")));
+
+#define lt_flags (lt->lt_flags)
+#define script_chunks (lt->script_chunks)
+#define script_chunk_count (lt->script_chunk_count)
+#define script_chunk_limit (lt->script_chunk_limit)
+
+#define heap (lt->heap)
+#define ints (lt->ints)
+#define dbls (lt->dbls)
+#define strs (lt->strs)
+#define vecs (lt->vecs)
+#define maps (lt->maps)
+#define cors (lt->cors)
+#define subs (lt->subs)
+#define slcs (lt->slcs)
+#define ios (lt->ios)
+#define chans (lt->chans)
+#define nodes (lt->nodes)
+
+#define int_count (lt->int_count)
+#define int_created (lt->int_created)
+#define int_destroyed (lt->int_destroyed)
+#define dbl_count (lt->dbl_count)
+#define dbl_created (lt->dbl_created)
+#define dbl_destroyed (lt->dbl_destroyed)
+#define str_count (lt->str_count)
+#define str_created (lt->str_created)
+#define str_destroyed (lt->str_destroyed)
+#define vec_count (lt->vec_count)
+#define vec_created (lt->vec_created)
+#define vec_destroyed (lt->vec_destroyed)
+#define map_count (lt->map_count)
+#define map_created (lt->map_created)
+#define map_destroyed (lt->map_destroyed)
+#define cor_count (lt->cor_count)
+#define cor_created (lt->cor_created)
+#define cor_destroyed (lt->cor_destroyed)
+#define sub_count (lt->sub_count)
+#define sub_created (lt->sub_created)
+#define sub_destroyed (lt->sub_destroyed)
+#define slc_count (lt->slc_count)
+#define slc_created (lt->slc_created)
+#define slc_destroyed (lt->slc_destroyed)
+#define io_count (lt->io_count)
+#define io_created (lt->io_created)
+#define io_destroyed (lt->io_destroyed)
+
+#define heap_mem (lt->heap_mem)
+#define ints_mem (lt->ints_mem)
+#define dbls_mem (lt->dbls_mem)
+#define strs_mem (lt->strs_mem)
+#define vecs_mem (lt->vecs_mem)
+#define maps_mem (lt->maps_mem)
+#define cors_mem (lt->cors_mem)
+#define subs_mem (lt->subs_mem)
+#define slcs_mem (lt->slcs_mem)
+#define ios_mem (lt->ios_mem)
+#define chans_mem (lt->chans_mem)
+
+#define scope_core (lt->scope_core)
+#define scope_global (lt->scope_global)
+#define super_str (lt->super_str)
+#define super_vec (lt->super_vec)
+#define super_map (lt->super_map)
+
+#define routines (lt->routines)
+#define routine_count (lt->routine_count)
+#define routine_limit (lt->routine_limit)
+#define routine_top (lt->routine_top)
+
+#define code (lt->code)
+#define code_count (lt->code_count)
+#define code_limit (lt->code_limit)
+
+#define stream_output (lt->stream_output)
+#define stream_input (lt->stream_input)
+#define output_tty (lt->output_tty)
+#define output_length (lt->output_length)
+#define output_buffer (lt->output_buffer)
+
+#define cor_pool (lt->cor_pool)
+#define cor_pooled (lt->cor_pooled)
+
+#define collect_pending (lt->collect_pending)
+#define collect_allocs (lt->collect_allocs)
+#define collect_urgent (lt->collect_urgent)
+#define collect_urges (lt->collect_urges)
+#define collect_urge_wait (lt->collect_urge_wait)
+#define collect_threshold (lt->collect_threshold)
+#define collect_runs (lt->collect_runs)
+#define collect_freed (lt->collect_freed)
+#define collect_slices (lt->collect_slices)
+#define collect_reconciles (lt->collect_reconciles)
+#define collect_reclaimed (lt->collect_reclaimed)
+#define collect_pause_total (lt->collect_pause_total)
+#define collect_pause_max (lt->collect_pause_max)
+#define collect_pause_last (lt->collect_pause_last)
+#define collect_phase (lt->collect_phase)
+#define collect_cursor (lt->collect_cursor)
+#define collect_kept (lt->collect_kept)
+#define collect_buffer (lt->collect_buffer)
+#define collect_cycle (lt->collect_cycle)
+#define collect_zct (lt->collect_zct)
+#define collect_zct_limit (lt->collect_zct_limit)
+#define collect_zct_floor (lt->collect_zct_floor)
+#define collect_traced (lt->collect_traced)
+#define collect_work (lt->collect_work)
+#define collect_cands (lt->collect_cands)
+
+#define sched_queue (lt->sched_queue)
+#define sched_head (lt->sched_head)
+#define sched_queued (lt->sched_queued)
+#define sched_limit (lt->sched_limit)
+#define sched_waits (lt->sched_waits)
+#define sched_wait_limit (lt->sched_wait_limit)
+#define sched_parked (lt->sched_parked)
+#define sched_epoll (lt->sched_epoll)
+#define sched_ring (lt->sched_ring)
+#define sched_count (lt->sched_count)
+#define sched_turns (lt->sched_turns)
+#define sched_home (lt->sched_home)
+#define sched_current (lt->sched_current)
+
+#define ring_enabled (lt->ring_enabled)
+#define ring_fd (lt->ring_fd)
+#define ring_reads (lt->ring_reads)
+#define ring_submits (lt->ring_submits)
+#define ring_queued (lt->ring_queued)
+#define ring_flight (lt->ring_flight)
+#define ring_map (lt->ring_map)
+#define ring_map_bytes (lt->ring_map_bytes)
+#define ring_sq_tail (lt->ring_sq_tail)
+#define ring_sq_mask (lt->ring_sq_mask)
+#define ring_sq_array (lt->ring_sq_array)
+#define ring_sqes (lt->ring_sqes)
+#define ring_sqes_bytes (lt->ring_sqes_bytes)
+#define ring_cq_head (lt->ring_cq_head)
+#define ring_cq_tail (lt->ring_cq_tail)
+#define ring_cq_mask (lt->ring_cq_mask)
+#define ring_cqes (lt->ring_cqes)
+#define ring_cq_entries (lt->ring_cq_entries)
+
+#define line_table (lt->line_table)
+#define line_bytes (lt->line_bytes)
+#define line_limit (lt->line_limit)
+#define line_entries (lt->line_entries)
+#define line_points (lt->line_points)
+#define line_point_count (lt->line_point_count)
+#define line_point_limit (lt->line_point_limit)
+#define line_last (lt->line_last)
+#define line_prev (lt->line_prev)
+
+#define source_root (lt->source_root)
+#define line_source (lt->line_source)
+#define line_cursor (lt->line_cursor)
+#define line_number (lt->line_number)
+
+#define parallel_pool (lt->parallel_pool)
+#define parallel_workers (lt->parallel_workers)
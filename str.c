@@ -29,12 +29,23 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 #include "arena.h"
 #include "str.h"
 #include "vec.h"
 #include "map.h"
 #include "lt.h"
+#include "collect.h"
+#include "io.h"
+#include "sched.h"
+#include "line.h"
+#include "state.h"
 
 uint32_t
 str_djb_hash (const char *str)
@@ -44,6 +55,22 @@ str_djb_hash (const char *str)
   return hash;
 }
 
+uint32_t
+str_djb_hash_len (const char *str, int length)
+{
+  uint32_t hash = 5381;
+  for (int i = 0; i < length; hash = hash * 33 + str[i++]);
+  return hash;
+}
+
+uint64_t
+str_fnv_hash_len (const char *str, int length)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  for (int i = 0; i < length; i++) hash = (hash ^ (unsigned char)str[i]) * 1099511628211ULL;
+  return hash;
+}
+
 char*
 strf (char *pattern, ...)
 {
@@ -57,6 +84,9 @@ strf (char *pattern, ...)
 
   if (len > -1 && (result = arena_alloc(strs, len+1)) && result)
   {
+    if (COLLECT_FULL(strs))
+      collect_urge();
+
     str_count++;
     str_created++;
     va_start(args, pattern);
@@ -76,6 +106,10 @@ substr (char *start, int offset, int length)
     errorf("arena_alloc strs");
     stacktrace();
   }
+
+  if (COLLECT_FULL(strs))
+    collect_urge();
+
   strncpy(buffer, start+offset, length);
   buffer[length] = 0;
   str_count++;
@@ -126,14 +160,14 @@ str_unquote (char *str, char **err)
 
     if (c == '\\')
     {
-           if (*sp == 'a') c = '\a';
-      else if (*sp == 'b') c = '\b';
-      else if (*sp == 'f') c = '\f';
-      else if (*sp == 'n') c = '\n';
-      else if (*sp == 'r') c = '\r';
-      else if (*sp == 't') c = '\t';
-      else if (*sp == 'v') c = '\v';
-      else c = *sp++;
+      c = *sp++;
+           if (c == 'a') c = '\a';
+      else if (c == 'b') c = '\b';
+      else if (c == 'f') c = '\f';
+      else if (c == 'n') c = '\n';
+      else if (c == 'r') c = '\r';
+      else if (c == 't') c = '\t';
+      else if (c == 'v') c = '\v';
     }
     *rp++ = c;
   }
@@ -160,3 +194,156 @@ str_scan (char *source, strcb cb)
   while (source[offset] && !cb(source[offset])) offset++;
   return offset;
 }
+
+static void
+ensure_slc (slc_t *slc, const char *func)
+{
+  ensure(is_slc(slc)) errorf("%s not a slc_t", func);
+}
+
+static slc_t*
+slc_new ()
+{
+  slc_count++;
+  slc_created++;
+  slc_t *slc = arena_alloc(slcs, sizeof(slc_t));
+
+  ensure(slc)
+  {
+    stacktrace();
+    errorf("arena_alloc slcs");
+  }
+  memset(slc, 0, sizeof(slc_t));
+  return slc;
+}
+
+slc_t*
+slc_alloc (char *str)
+{
+  slc_t *slc = slc_new();
+
+  // root slice takes ownership of str
+  slc->str = str;
+  slc->length = strlen(str);
+  return slc;
+}
+
+static size_t
+slc_mapped_bytes (size_t length)
+{
+  size_t page = sysconf(_SC_PAGESIZE);
+  return length + page - (length % page);
+}
+
+slc_t*
+slc_mmap (char *path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > INT_MAX)
+  {
+    close(fd);
+    return NULL;
+  }
+
+  if (st.st_size == 0)
+  {
+    close(fd);
+    return slc_alloc(strf(""));
+  }
+
+  // reserve an extra zeroed page so the mapping is always null-terminated,
+  // then map the file over the front of it
+  size_t bytes = slc_mapped_bytes(st.st_size);
+
+  char *str = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+
+  if (str != MAP_FAILED && mmap(str, st.st_size, PROT_READ, MAP_PRIVATE|MAP_FIXED, fd, 0) == MAP_FAILED)
+  {
+    munmap(str, bytes);
+    str = MAP_FAILED;
+  }
+  close(fd);
+
+  if (str == MAP_FAILED)
+    return NULL;
+
+  slc_t *slc = slc_new();
+  slc->str = str;
+  slc->length = st.st_size;
+  slc->flags |= SLC_MAPPED;
+  return slc;
+}
+
+slc_t*
+slc_sub (slc_t *slc, int offset, int length)
+{
+  ensure_slc(slc, __func__);
+
+  slc_t *root = slc->root ? slc->root: slc;
+  offset += slc->offset;
+
+  ensure(offset >= 0 && length >= 0 && offset + length <= root->length)
+    errorf("%s out of bounds %d %d", __func__, offset, length);
+
+  slc_t *sub = slc_new();
+  sub->root = slc_incref(root);
+  sub->str = root->str;
+  sub->offset = offset;
+  sub->length = length;
+  return sub;
+}
+
+slc_t*
+slc_incref (slc_t *slc)
+{
+  ensure_slc(slc, __func__);
+
+  slc->ref_count++;
+  return slc;
+}
+
+slc_t*
+slc_decref (slc_t *slc)
+{
+  ensure_slc(slc, __func__);
+
+  if (--slc->ref_count == 0)
+  {
+    if (slc->root)
+      slc_decref(slc->root);
+    else
+    if (slc->flags & SLC_MAPPED)
+      munmap(slc->str, slc_mapped_bytes(slc->length));
+    else
+      discard(slc->str);
+
+    memset(slc, 0, sizeof(slc_t));
+    arena_free(slcs, slc);
+    slc_count--;
+    slc_destroyed++;
+    slc = NULL;
+  }
+  return slc;
+}
+
+char*
+slc_str (slc_t *slc)
+{
+  ensure_slc(slc, __func__);
+
+  return substr(slc->str, slc->offset, slc->length);
+}
+
+// unmap the files behind any slices still alive when an interpreter closes
+void
+slc_unmap_all ()
+{
+  for (slc_t *slc = arena_next(slcs, NULL); slc; slc = arena_next(slcs, slc))
+  {
+    if (!slc->root && slc->flags & SLC_MAPPED)
+      munmap(slc->str, slc_mapped_bytes(slc->length));
+  }
+}
@@ -23,10 +23,33 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 typedef int (*strcb)(int);
 
+// A read-only view of part of a string. Roots own a strs string or a
+// mapped file; other slices hold a reference to their root and share its
+// bytes.
+typedef struct _slc_t {
+  struct _slc_t *root;
+  char *str;
+  int offset;
+  int length;
+  int ref_count;
+  int flags;
+} slc_t;
+
+#define SLC_MAPPED (1<<0)
+
 uint32_t str_djb_hash (const char*);
+uint32_t str_djb_hash_len (const char*, int);
+uint64_t str_fnv_hash_len (const char*, int);
 char* strf (char*, ...);
 char* substr (char*, int, int);
 char* str_quote (char*);
 char* str_unquote (char*, char**);
 int str_skip (char*, strcb);
 int str_scan (char*, strcb);
+slc_t* slc_alloc (char*);
+slc_t* slc_mmap (char*);
+slc_t* slc_sub (slc_t*, int, int);
+slc_t* slc_incref (slc_t*);
+slc_t* slc_decref (slc_t*);
+char* slc_str (slc_t*);
+void slc_unmap_all ();
@@ -0,0 +1,28 @@
+#!/bin/sh
+# A handled signal that interrupts io.run() while its only task is parked
+# must not end the run; the task still gets its line.
+#
+#   sh test/parked-signal.sh ./lt [options]
+
+LT=$1
+shift
+SCRIPT=${TMPDIR:-/tmp}/lt-signal.$$.lt
+
+trap 'rm -f "$SCRIPT"' EXIT
+
+cat >"$SCRIPT" <<'LT'
+io.spawn(function ()
+  line = io.read()
+  print("read " .. line)
+end)
+io.run()
+print("run returned")
+LT
+
+# --profile handles SIGPROF, so the parked epoll_wait sees EINTR
+(sleep 2; echo hello) | "$LT" "$@" --profile "$SCRIPT" 2>/dev/null &
+pid=$!
+
+sleep 1
+kill -s PROF $pid
+wait $pid
@@ -0,0 +1,41 @@
+#!/bin/sh
+# Run each test/*.lt script and compare its output against
+# test/<name>.out. A test/*.sh script drives ./lt itself, for tests that
+# need a pipe or a signal, and gets the interpreter path as its argument.
+#
+#   sh test/run.sh [./lt]
+
+LT=${1:-./lt}
+DIR=$(dirname "$0")
+OUT=${TMPDIR:-/tmp}/lt-test.$$
+failed=0
+
+trap 'rm -f "$OUT"' EXIT
+
+for script in "$DIR"/*.lt
+do
+  name=$(basename "$script" .lt)
+
+  if ! "$LT" "$script" </dev/null >"$OUT" 2>&1 || ! cmp -s "$OUT" "$DIR/$name.out"
+  then
+    echo "$name: failed"
+    tail -5 "$OUT"
+    failed=1
+  fi
+done
+
+for script in "$DIR"/*.sh
+do
+  name=$(basename "$script" .sh)
+  [ "$name" = run ] && continue
+
+  if ! sh "$script" "$LT" >"$OUT" 2>&1 || ! cmp -s "$OUT" "$DIR/$name.out"
+  then
+    echo "$name: failed"
+    tail -5 "$OUT"
+    failed=1
+  fi
+done
+
+[ $failed = 0 ] && echo "all passed"
+exit $failed
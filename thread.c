@@ -0,0 +1,569 @@
+/*
+Copyright (c) 2016 Sean Pringle sean.pringle@gmail.com
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "arena.h"
+#include "op.h"
+#include "str.h"
+#include "vec.h"
+#include "map.h"
+#include "parse.h"
+#include "lt.h"
+#include "collect.h"
+#include "io.h"
+#include "sched.h"
+#include "line.h"
+#include "thread.h"
+#include "channel.h"
+#include "state.h"
+
+enum {
+  MSG_NIL = 0,
+  MSG_TRUE,
+  MSG_FALSE,
+  MSG_INT,
+  MSG_DBL,
+  MSG_STR,
+  MSG_VEC,
+  MSG_MAP,
+  MSG_CHAN,
+};
+
+// A spawned interpreter runs either a script by path, or one function of
+// the spawning script from an image of it.
+typedef struct {
+  pthread_t thread;
+  char *script;
+  image_t image;
+  int entry;
+  msg_t args;
+  msg_t result;
+} thread_t;
+
+// handles are process-wide, so any interpreter may join any thread
+static pthread_mutex_t thread_mutex = PTHREAD_MUTEX_INITIALIZER;
+static thread_t **threads;
+static int thread_limit;
+
+static void
+msg_put (msg_t *msg, const void *ptr, int bytes)
+{
+  if (msg->length + bytes > msg->limit)
+  {
+    msg->limit = (msg->length + bytes) * 2;
+    msg->data = realloc(msg->data, msg->limit);
+    ensure(msg->data) errorf("%s realloc", __func__);
+  }
+  memcpy(msg->data + msg->length, ptr, bytes);
+  msg->length += bytes;
+}
+
+static void
+msg_get (msg_t *msg, int *offset, void *ptr, int bytes)
+{
+  ensure(*offset + bytes <= msg->length)
+    errorf("%s truncated message", __func__);
+
+  memcpy(ptr, msg->data + *offset, bytes);
+  *offset += bytes;
+}
+
+static void
+msg_tag (msg_t *msg, unsigned char tag)
+{
+  msg_put(msg, &tag, 1);
+}
+
+static void
+msg_value (msg_t *msg, void *ptr, int depth)
+{
+  ensure(depth < MSG_DEPTH)
+  {
+    errorf("message nested too deeply; cyclic?");
+    stacktrace();
+  }
+
+  if (!ptr)
+  {
+    msg_tag(msg, MSG_NIL);
+    return;
+  }
+
+  if (is_bool(ptr))
+  {
+    msg_tag(msg, get_bool(ptr) ? MSG_TRUE: MSG_FALSE);
+    return;
+  }
+
+  if (is_int(ptr))
+  {
+    int64_t n = get_int(ptr);
+    msg_tag(msg, MSG_INT);
+    msg_put(msg, &n, sizeof(n));
+    return;
+  }
+
+  if (is_dbl(ptr))
+  {
+    double d = get_dbl(ptr);
+    msg_tag(msg, MSG_DBL);
+    msg_put(msg, &d, sizeof(d));
+    return;
+  }
+
+  if (is_text(ptr))
+  {
+    int length = count(ptr);
+    msg_tag(msg, MSG_STR);
+    msg_put(msg, &length, sizeof(length));
+    msg_put(msg, get_str(ptr), length);
+    return;
+  }
+
+  if (is_vec(ptr))
+  {
+    vec_t *vec = ptr;
+    int items = vec->count;
+    msg_tag(msg, MSG_VEC);
+    msg_put(msg, &items, sizeof(items));
+
+    for (int i = 0; i < items; i++)
+      msg_value(msg, vec_get(vec, i)[0], depth+1);
+    return;
+  }
+
+  if (is_chan(ptr))
+  {
+    struct channel *channel = channel_hold(((chan_t*)ptr)->channel);
+    msg_tag(msg, MSG_CHAN);
+    msg_put(msg, &channel, sizeof(channel));
+
+    if (msg->holds == msg->hold_limit)
+    {
+      msg->hold_limit = msg->hold_limit ? msg->hold_limit * 2: 4;
+      msg->held = realloc(msg->held, sizeof(void*) * msg->hold_limit);
+      ensure(msg->held) errorf("%s realloc", __func__);
+    }
+    msg->held[msg->holds++] = channel;
+    return;
+  }
+
+  ensure(is_map(ptr))
+  {
+    errorf("only nil, booleans, numbers, strings, arrays, tables and channels cross threads");
+    stacktrace();
+  }
+
+  map_t *map = ptr;
+  int items = map->count;
+  msg_tag(msg, MSG_MAP);
+  msg_put(msg, &items, sizeof(items));
+
+  for (int chain = 0; chain < 17; chain++)
+  {
+    for (node_t *node = map->chains[chain]; node; node = node->next)
+    {
+      msg_value(msg, node->key, depth+1);
+      msg_value(msg, node->val, depth+1);
+    }
+  }
+}
+
+// append a deep copy of a value
+void
+msg_pack (msg_t *msg, void *ptr)
+{
+  msg_value(msg, ptr, 0);
+}
+
+// the value at offset, rebuilt in the current interpreter
+void*
+msg_unpack (msg_t *msg, int *offset)
+{
+  unsigned char tag;
+  msg_get(msg, offset, &tag, 1);
+
+  switch (tag)
+  {
+    case MSG_NIL:
+      return NULL;
+
+    case MSG_TRUE:
+    case MSG_FALSE:
+      return to_bool(tag == MSG_TRUE);
+
+    case MSG_INT:
+    {
+      int64_t n;
+      msg_get(msg, offset, &n, sizeof(n));
+      return to_int(n);
+    }
+
+    case MSG_DBL:
+    {
+      double d;
+      msg_get(msg, offset, &d, sizeof(d));
+      return to_dbl(d);
+    }
+
+    case MSG_STR:
+    {
+      int length;
+      msg_get(msg, offset, &length, sizeof(length));
+
+      ensure(*offset + length <= msg->length)
+        errorf("%s truncated message", __func__);
+
+      char *str = substr((char*)msg->data + *offset, 0, length);
+      *offset += length;
+      return str;
+    }
+
+    case MSG_VEC:
+    {
+      int items;
+      msg_get(msg, offset, &items, sizeof(items));
+
+      vec_t *vec = vec_alloc();
+
+      for (int i = 0; i < items; i++)
+        vec_push(vec)[0] = store(msg_unpack(msg, offset));
+
+      return vec;
+    }
+
+    case MSG_MAP:
+    {
+      int items;
+      msg_get(msg, offset, &items, sizeof(items));
+
+      map_t *map = map_alloc();
+
+      for (int i = 0; i < items; i++)
+      {
+        void *key = msg_unpack(msg, offset);
+        map_set(map, key)[0] = store(msg_unpack(msg, offset));
+        discard(key);
+      }
+
+      return map;
+    }
+
+    case MSG_CHAN:
+    {
+      struct channel *channel;
+      msg_get(msg, offset, &channel, sizeof(channel));
+      return chan_incref(chan_alloc(channel));
+    }
+  }
+
+  ensure(0) errorf("%s bad tag %d", __func__, tag);
+  return NULL;
+}
+
+// empty a message for reuse, keeping its buffer
+void
+msg_clear (msg_t *msg)
+{
+  for (int i = 0; i < msg->holds; i++)
+    channel_release(msg->held[i]);
+
+  msg->holds = 0;
+  msg->length = 0;
+}
+
+void
+msg_free (msg_t *msg)
+{
+  msg_clear(msg);
+  free(msg->data);
+  free(msg->held);
+  memset(msg, 0, sizeof(msg_t));
+}
+
+// Capture what a new interpreter needs to run functions of the current
+// script: it compiles the same source, which gives the same code offsets,
+// and calls functions without running the top level. Global variables
+// holding functions are offsets too, so they go along as name/offset
+// pairs; other globals stay behind.
+void
+image_capture (image_t *image)
+{
+  ensure(script_chunk_count)
+    errorf("no script source to run a function from");
+
+  image->chunks = script_chunk_count;
+  image->chunk_lengths = malloc(sizeof(int) * image->chunks);
+  ensure(image->chunk_lengths) errorf("%s malloc", __func__);
+
+  image->length = 0;
+
+  for (int i = 0; i < image->chunks; i++)
+    image->length += image->chunk_lengths[i] = script_chunks[i]->length;
+
+  image->source = malloc(image->length);
+  ensure(image->source) errorf("%s malloc", __func__);
+
+  for (int i = 0, offset = 0; i < image->chunks; offset += image->chunk_lengths[i++])
+    memcpy(image->source + offset, get_str(script_chunks[i]), image->chunk_lengths[i]);
+
+  image->code_size = code_count;
+  image->memory = heap_mem;
+  image->flags = lt_flags;
+
+  image_functions(&image->functions);
+}
+
+// the global function bindings of the current interpreter
+void
+image_functions (msg_t *msg)
+{
+  msg_clear(msg);
+
+  for (int chain = 0; chain < 17; chain++)
+  {
+    for (node_t *node = scope_global->chains[chain]; node; node = node->next)
+    {
+      if (!is_sub(node->val) || !is_text(node->key)) continue;
+
+      msg_pack(msg, node->key);
+      void *entry = to_int(get_sub(node->val));
+      msg_pack(msg, entry);
+      discard(entry);
+    }
+  }
+}
+
+// bind global functions captured by image_functions()
+void
+image_bind (msg_t *msg)
+{
+  int offset = 0;
+
+  while (offset < msg->length)
+  {
+    void *name = msg_unpack(msg, &offset);
+    void *entry = msg_unpack(msg, &offset);
+    map_set(scope_global, name)[0] = to_sub(get_int(entry));
+    discard(name);
+    discard(entry);
+  }
+}
+
+// open a new interpreter on the calling thread, ready to call functions
+void
+image_open (image_t *image)
+{
+  lt_open(image->memory, image->flags);
+
+  // chunk by chunk, as they were loaded
+  for (int i = 0, offset = 0; i < image->chunks; offset += image->chunk_lengths[i++])
+  {
+    slc_t *text = slc_alloc(substr(image->source, offset, image->chunk_lengths[i]));
+    script_keep(slc_incref(text));
+    source(slc_incref(text));
+  }
+
+  ensure(code_count == image->code_size)
+    errorf("the script compiled differently");
+
+  image_bind(&image->functions);
+}
+
+void
+image_free (image_t *image)
+{
+  msg_free(&image->functions);
+  free(image->chunk_lengths);
+  free(image->source);
+  memset(image, 0, sizeof(image_t));
+}
+
+static void*
+thread_main (void *arg)
+{
+  thread_t *thread = arg;
+
+  if (thread->script)
+  {
+    lt_open(thread->image.memory, thread->image.flags);
+
+    slc_t *text = slc_mmap(thread->script);
+
+    ensure(text)
+      errorf("thread.spawn: failed to read %s", thread->script);
+
+    script_keep(slc_incref(text));
+    source(slc_incref(text));
+    run();
+  }
+  else
+  {
+    image_open(&thread->image);
+    op_mark();
+
+    int args = 0;
+    int offset = 0;
+
+    while (offset < thread->args.length)
+    {
+      push(msg_unpack(&thread->args, &offset));
+      args++;
+    }
+
+    if (call(thread->entry, args))
+      msg_pack(&thread->result, item(0)[0]);
+
+    while (depth()) op_drop();
+    op_unmark();
+  }
+
+  lt_close(lt);
+  return NULL;
+}
+
+// Start a thread running a script, given its path, or a function of the
+// running script with the args stack items after target as its arguments.
+// Returns the thread's handle.
+int
+thread_spawn (void *target, int args)
+{
+  thread_t *thread = calloc(1, sizeof(thread_t));
+  ensure(thread) errorf("%s calloc", __func__);
+
+  if (is_sub(target))
+  {
+    image_capture(&thread->image);
+    thread->entry = get_sub(target);
+
+    for (int i = 1; i <= args; i++)
+      msg_pack(&thread->args, item(i)[0]);
+  }
+  else
+  {
+    ensure(is_text(target))
+    {
+      errorf("thread.spawn: expected a script path or a function");
+      stacktrace();
+    }
+
+    thread->script = strndup(get_str(target), count(target));
+    ensure(thread->script) errorf("%s strndup", __func__);
+
+    thread->image.memory = heap_mem;
+    thread->image.flags = lt_flags;
+  }
+
+  pthread_mutex_lock(&thread_mutex);
+
+  int handle = 0;
+  while (handle < thread_limit && threads[handle]) handle++;
+
+  if (handle == thread_limit)
+  {
+    thread_limit = thread_limit ? thread_limit * 2: 16;
+    threads = realloc(threads, sizeof(thread_t*) * thread_limit);
+    ensure(threads) errorf("%s realloc", __func__);
+    memset(&threads[handle], 0, sizeof(thread_t*) * (thread_limit - handle));
+  }
+
+  threads[handle] = thread;
+  pthread_mutex_unlock(&thread_mutex);
+
+  ensure(!pthread_create(&thread->thread, NULL, thread_main, thread))
+    errorf("thread.spawn: pthread_create failed");
+
+  return handle + 1;
+}
+
+static void
+thread_free (thread_t *thread)
+{
+  msg_free(&thread->args);
+  msg_free(&thread->result);
+  image_free(&thread->image);
+  free(thread->script);
+  free(thread);
+}
+
+// Wait for a thread and push the first value its function returned, or
+// nil. Returns 0 when the handle is unknown or already joined.
+int
+thread_join (int handle)
+{
+  pthread_mutex_lock(&thread_mutex);
+
+  thread_t *thread = handle > 0 && handle <= thread_limit ? threads[handle-1]: NULL;
+
+  if (thread)
+    threads[handle-1] = NULL;
+
+  pthread_mutex_unlock(&thread_mutex);
+
+  if (!thread)
+    return 0;
+
+  pthread_join(thread->thread, NULL);
+
+  int offset = 0;
+  push(thread->result.length ? msg_unpack(&thread->result, &offset): NULL);
+
+  thread_free(thread);
+  return 1;
+}
+
+// the process ends when the main script and every thread have finished
+void
+thread_join_all ()
+{
+  for (;;)
+  {
+    pthread_mutex_lock(&thread_mutex);
+
+    thread_t *thread = NULL;
+
+    for (int i = 0; i < thread_limit && !thread; i++)
+    {
+      thread = threads[i];
+      threads[i] = NULL;
+    }
+
+    pthread_mutex_unlock(&thread_mutex);
+
+    if (!thread)
+      break;
+
+    pthread_join(thread->thread, NULL);
+
+    thread_free(thread);
+  }
+}
@@ -0,0 +1,69 @@
+/*
+Copyright (c) 2016 Sean Pringle sean.pringle@gmail.com
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+// thread.spawn() starts a script, or a function of the running script, in
+// a new interpreter on its own OS thread. Interpreters share nothing but
+// channels, so values cross between them only as messages: a message is a
+// deep copy of nil, booleans, numbers, strings, arrays and tables, packed
+// into malloc'd memory by one interpreter and unpacked into the arenas of
+// another. A channel goes by reference, which the message holds until it
+// is cleared or freed.
+
+#define MSG_DEPTH 64
+
+typedef struct {
+  unsigned char *data;
+  int length;
+  int limit;
+  void **held;
+  int holds;
+  int hold_limit;
+} msg_t;
+
+void msg_pack (msg_t*, void*);
+void* msg_unpack (msg_t*, int*);
+void msg_clear (msg_t*);
+void msg_free (msg_t*);
+
+// a script's source and global functions, to open more interpreters with
+typedef struct {
+  char *source;
+  int length;
+  int *chunk_lengths;
+  int chunks;
+  int code_size;
+  int memory;
+  int flags;
+  msg_t functions;
+} image_t;
+
+void image_capture (image_t*);
+void image_functions (msg_t*);
+void image_bind (msg_t*);
+void image_open (image_t*);
+void image_free (image_t*);
+
+int thread_spawn (void*, int);
+int thread_join (int);
+void thread_join_all ();
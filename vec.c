@@ -28,6 +28,7 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <stdint.h>
 #include <stdarg.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "arena.h"
 #include "op.h"
@@ -35,6 +36,11 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "vec.h"
 #include "map.h"
 #include "lt.h"
+#include "collect.h"
+#include "io.h"
+#include "sched.h"
+#include "line.h"
+#include "state.h"
 
 #define VEC_STEP 32
 
@@ -52,6 +58,14 @@ vec_alloc ()
   }
   vec->items = heap_alloc(sizeof(void*) * VEC_STEP);
   vec->count = 0;
+  vec->flags = 0;
+
+  if (++collect_allocs == collect_threshold)
+    collect_pending = 1;
+
+  if (COLLECT_FULL(vecs))
+    collect_urge();
+
   return vec;
 }
 
@@ -61,6 +75,14 @@ ensure_vec (vec_t *vec, const char *func)
   ensure(is_vec(vec)) errorf("%s not a vec_t", func);
 }
 
+// drop a reference held by this vec
+static void
+vec_drop (vec_t *vec, void *ptr)
+{
+  if (vec->flags & VEC_SCOPES) map_unscope(ptr);
+  else discard(vec->flags & VEC_ROOT ? ptr: unstore(ptr));
+}
+
 void**
 vec_ins (vec_t *vec, int index)
 {
@@ -89,7 +111,7 @@ vec_set (vec_t *vec, int index)
 
   if (index == vec->count) return vec_ins(vec, index);
 
-  discard(vec->items[index]);
+  vec_drop(vec, vec->items[index]);
   vec->items[index] = NULL;
 
   return &vec->items[index];
@@ -138,18 +160,38 @@ vec_empty (vec_t *vec)
   ensure_vec(vec, __func__);
 
   for (int i = 0; i < vec->count; i++)
-    discard(vec->items[i]);
+    vec_drop(vec, vec->items[i]);
   heap_free(vec->items);
   memset(vec, 0, sizeof(vec_t));
   return vec;
 }
 
+// drop the items but keep the vec for reuse, with a buffer of the
+// starting size
+vec_t*
+vec_clear (vec_t *vec)
+{
+  ensure_vec(vec, __func__);
+
+  for (int i = 0; i < vec->count; i++)
+    vec_drop(vec, vec->items[i]);
+
+  if (vec->count >= VEC_STEP)
+  {
+    heap_free(vec->items);
+    vec->items = heap_alloc(sizeof(void*) * VEC_STEP);
+  }
+  vec->count = 0;
+  return vec;
+}
+
 vec_t*
 vec_incref (vec_t *vec)
 {
   ensure_vec(vec, __func__);
 
   vec->ref_count++;
+  vec->flags &= ~GC_COLOR;
   return vec;
 }
 
@@ -159,16 +201,26 @@ vec_decref (vec_t *vec)
   ensure_vec(vec, __func__);
 
   if (--vec->ref_count == 0)
-  {
-    vec_empty(vec);
-    arena_free(vecs, vec);
-    vec_count--;
-    vec_destroyed++;
-    vec = NULL;
-  }
+    collect_zero(vec, &vec->flags);
+  else
+  if ((vec->flags & GC_COLOR) != GC_PURPLE)
+    collect_root(vec, &vec->flags);
   return vec;
 }
 
+// free a vec nothing refers to; a listed vec stays behind as a shell for
+// its list to free
+void
+vec_free (vec_t *vec)
+{
+  unsigned int listed = vec->flags & (GC_BUFFERED|GC_ZCT);
+  vec_empty(vec);
+  vec_count--;
+  vec_destroyed++;
+  if (listed) vec->flags = listed|GC_SHELL;
+  else arena_free(vecs, vec);
+}
+
 char*
 vec_char (vec_t *vec)
 {
@@ -21,11 +21,18 @@ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
 SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 */
 
+// a coroutine's stack, scopes and other root vecs hold uncounted
+// references; the scopes vec owns its scope maps
+#define VEC_ROOT (1<<0)
+#define VEC_SCOPES (1<<1)
+
 typedef struct {
   void **items;
   unsigned int count;
   unsigned int current;
+  unsigned int flags;
   int ref_count;
+  int crc;
 } vec_t;
 
 vec_t* vec_alloc ();
@@ -36,6 +43,8 @@ void* vec_del (vec_t*,int);
 void* vec_pop (vec_t*);
 void** vec_get (vec_t*,int);
 vec_t* vec_empty (vec_t*);
+vec_t* vec_clear (vec_t*);
 vec_t* vec_incref (vec_t*);
 vec_t* vec_decref (vec_t*);
+void vec_free (vec_t*);
 char* vec_char (vec_t*);